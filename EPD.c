@@ -1,5 +1,40 @@
 #include "EPD.h"
 #include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/moduleparam.h>
+#include <linux/interrupt.h>
+#include <linux/completion.h>
+#include <linux/jiffies.h>
+
+#define EPD_STAGE_SIZE 128      // 参数字节暂存区, 够放一整张 70 字节 LUT
+#define EPD_BUSY_POLL_MS 10     // 没有 BUSY 中断时的轮询间隔
+#define EPD_PANIC_XFER 16       // panic 时每个 SPI 事务的字节数, 短到控制器轮询完成
+#define EPD_PANIC_BUSY_MS 2000  // panic 时每次等 BUSY 的上限
+
+static unsigned int busy_timeout_ms = 5000;
+module_param(busy_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(busy_timeout_ms, "Give up waiting for BUSY after this many ms");
+
+// BUSY 下降沿中断, 0 表示轮询
+static int busy_irq;
+static DECLARE_COMPLETION(busy_done);
+
+// 暂存的参数字节, 下一条命令 / WaitBusy / 屏障时一次发出
+static UBYTE *stage_buf;
+static UWORD stage_len;
+static int dc_level = -1;
+static int lut_part = -1;   // 控制器里当前的波形: 1 局刷, 0 全刷, -1 未知
+
+// SPI 事务计数 (只读模块参数)
+static unsigned int xfer_cmds;
+static unsigned int xfer_data_bytes;
+static unsigned int xfer_transfers;
+static unsigned int xfer_saved;
+module_param(xfer_cmds, uint, 0444);
+module_param(xfer_data_bytes, uint, 0444);
+module_param(xfer_transfers, uint, 0444);
+module_param(xfer_saved, uint, 0444);
+MODULE_PARM_DESC(xfer_saved, "SPI transactions saved by data coalescing");
 
 const unsigned char EPD_2IN13_V2_lut_full_update[]= {
     0x80,0x60,0x40,0x00,0x00,0x00,0x00,             //LUT0: BB:     VS 0 ~7
@@ -48,33 +83,135 @@ static void EPD_Reset(void) {
     msleep(200);
 }
 
+// 只在电平真正变化时才切 DC
+static void EPD_SetDC(int level) {
+    if (dc_level != level) {
+        GPIO_Write(EPD_DC_PIN, level);
+        dc_level = level;
+    }
+}
+
+// 把暂存的参数字节作为一次 CS 事务发出; 也可作为显式屏障调用
+static void EPD_SendBarrier(void) {
+    if (!stage_len)
+        return;
+    EPD_SetDC(1);                 // DC=1表示数据
+    GPIO_Write(EPD_CS_PIN, 0);
+    SPI_Write(stage_buf, stage_len);
+    GPIO_Write(EPD_CS_PIN, 1);
+    xfer_transfers++;
+    xfer_saved += stage_len - 1;
+    stage_len = 0;
+}
+
 // 发送命令（合并CS和DC控制）
 static void EPD_SendCmd(UBYTE cmd) {
-    GPIO_Write(EPD_DC_PIN, 0);    // DC=0表示命令
+    EPD_SendBarrier();
+    EPD_SetDC(0);                 // DC=0表示命令
     GPIO_Write(EPD_CS_PIN, 0);
     SPI_TransferByte(cmd);      // 直接调用SPI传输
     GPIO_Write(EPD_CS_PIN, 1);
+    xfer_cmds++;
+    xfer_transfers++;
 }
 
-// 发送数据（优化为单次操作）
+// 发送数据（先进暂存区）
 static void EPD_SendData(UBYTE dat) {
-    GPIO_Write(EPD_DC_PIN, 1);    // DC=1表示数据
-    GPIO_Write(EPD_CS_PIN, 0);
-    SPI_TransferByte(dat);
-    GPIO_Write(EPD_CS_PIN, 1);
+    if (stage_len >= (oops_in_progress ? EPD_PANIC_XFER : EPD_STAGE_SIZE))
+        EPD_SendBarrier();
+    stage_buf[stage_len++] = dat;
+    xfer_data_bytes++;
+}
+
+static irqreturn_t EPD_BusyIrq(int irq, void *data) {
+    complete(&busy_done);
+    return IRQ_HANDLED;
 }
 
 // 忙等待
 static void EPD_WaitBusy(void) {
+    unsigned long deadline;
+    long left;
+
+    EPD_SendBarrier();
     Debug("e-Paper busy\r\n");
+
+    // panic 时不能睡眠, jiffies 也可能不再走, 按次数忙等, 有上限
+    if (oops_in_progress) {
+        for (left = 0; GPIO_Read(EPD_BUSY_PIN) == 1 &&
+             left < min_t(long, busy_timeout_ms, EPD_PANIC_BUSY_MS);
+             left += EPD_BUSY_POLL_MS)
+            mdelay(EPD_BUSY_POLL_MS);
+        return;
+    }
+
+    // 先清掉上一次残留的完成量, 再看电平, 下降沿不会丢
+    reinit_completion(&busy_done);
+    deadline = jiffies + msecs_to_jiffies(busy_timeout_ms);
     while(GPIO_Read(EPD_BUSY_PIN) == 1) {      //LOW: idle, HIGH: busy
-        msleep(100);
+        left = (long)(deadline - jiffies);
+        if (left <= 0) {
+            Debug("e-Paper busy timeout\r\n");
+            break;
+        }
+        if (busy_irq)
+            wait_for_completion_timeout(&busy_done, left);
+        else
+            msleep(EPD_BUSY_POLL_MS);
     }
     Debug("e-Paper busy release\r\n");
 }
 
 /*------------------------- 显示控制 -------------------------*/
+// 切换全刷 / 局刷波形, 已经是目标 LUT 时不重复下发.
+// 局刷要配合 0x37 打开 RAM ping-pong, 并先用 0x22 0xC0 打开时钟和模拟电路
+static void EPD_LoadLut(int part) {
+    const unsigned char *lut;
+    UBYTE count;
+
+    if (lut_part == part)
+        return;
+
+    if (part) {
+        lut = EPD_2IN13_V2_lut_partial_update;
+        EPD_SendCmd(0x2C); //VCOM Voltage
+        EPD_SendData(0x26);
+        EPD_WaitBusy();
+    } else {
+        lut = EPD_2IN13_V2_lut_full_update;
+        EPD_SendCmd(0x2C); //VCOM Voltage
+        EPD_SendData(0x55);
+    }
+
+    EPD_SendCmd(0x32);
+    for(count = 0; count < 70; count++) {
+        EPD_SendData(lut[count]);
+    }
+
+    EPD_SendCmd(0x37); // display option, 局刷打开 RAM ping-pong
+    EPD_SendData(0x00);
+    EPD_SendData(0x00);
+    EPD_SendData(0x00);
+    EPD_SendData(0x00);
+    EPD_SendData(part ? 0x40 : 0x00);
+    EPD_SendData(0x00);
+    EPD_SendData(0x00);
+
+    if (part) {
+        EPD_SendCmd(0x22);
+        EPD_SendData(0xC0); // enable clock + analog
+        EPD_SendCmd(0x20);
+        EPD_WaitBusy();
+    }
+
+    EPD_SendCmd(0x3C); //BorderWavefrom
+    EPD_SendData(part ? 0x01 : 0x03);
+
+    lut_part = part;
+}
+
 void EPD_RefreshDisplay(void) {
+    EPD_LoadLut(0);
     EPD_SendCmd(0x22);
     EPD_SendData(0xC7);  // 0xC7:全刷, 0x0C:局刷
     EPD_SendCmd(0x20);
@@ -82,6 +219,7 @@ void EPD_RefreshDisplay(void) {
 }
 
 void EPD_RefreshDisplayPart(void) {
+    EPD_LoadLut(1);
     EPD_SendCmd(0x22);
     EPD_SendData(0x0C);  // 0xC7:全刷, 0x0C:局刷
     EPD_SendCmd(0x20);
@@ -90,6 +228,13 @@ void EPD_RefreshDisplayPart(void) {
 
 /*------------------------- 初始化 -------------------------*/
 UBYTE DEV_Hardware_Init(void) {
+    // 暂存区要走 SPI DMA, 不能放在模块 .bss (vmalloc) 里
+    stage_buf = kmalloc(EPD_STAGE_SIZE, GFP_KERNEL);
+    if (!stage_buf)
+        return 1;
+    stage_len = 0;
+    dc_level = -1;
+
     spi_init();
 
     // 初始化GPIO
@@ -104,10 +249,22 @@ UBYTE DEV_Hardware_Init(void) {
     GPIO_Write(EPD_CS_PIN, 1);
     GPIO_Write(EPD_PWR_PIN, 1);
 
+    // BUSY 下降沿中断, 失败则退回轮询
+    busy_irq = gpio_to_irq(EPD_BUSY_PIN);
+    if (busy_irq <= 0 ||
+        request_irq(busy_irq, EPD_BusyIrq, IRQF_TRIGGER_FALLING, "epd-busy", NULL)) {
+        Debug("no busy irq, polling\r\n");
+        busy_irq = 0;
+    }
+
     return 0;
 }
 
 void DEV_Hardware_Exit(void) {
+    if (busy_irq) {
+        free_irq(busy_irq, NULL);
+        busy_irq = 0;
+    }
     spi_close();
 
     // 重置所有GPIO状态
@@ -121,6 +278,11 @@ void DEV_Hardware_Exit(void) {
     GPIO_Unexport(EPD_DC_PIN);
     GPIO_Unexport(EPD_RST_PIN);
     GPIO_Unexport(EPD_BUSY_PIN);
+
+    kfree(stage_buf);
+    stage_buf = NULL;
+    dc_level = -1;
+    lut_part = -1;
 }
 
 // 全刷参数
@@ -186,42 +348,53 @@ void EPD_init_full(void) {
     EPD_SendData(0x27); // F9
     EPD_SendData(0x01); // 00
     EPD_WaitBusy();
+    lut_part = 0;
+}
+
+// 局刷参数: 在 EPD_init_full 之后调用, 之后的 EPD_DisplayPart 不用再切波形
+void EPD_init_part(void) {
+    EPD_LoadLut(1);
+    EPD_SendBarrier();
 }
 
 /*------------------------- 高级功能 -------------------------*/
-void EPD_Clear() {
+// 整帧写入 RAM (0x24 新图 / 0x26 旧图), 地址计数器先回到起点
+static void EPD_WriteRam(UBYTE cmd, const UBYTE *Image) {
     UWORD j,i;
-    EPD_SendCmd(0x24);
+
+    EPD_SendCmd(0x4E);   // set RAM x address count to 0;
+    EPD_SendData(0x00);
+    EPD_SendCmd(0x4F);   // set RAM y address count to 0X127;
+    EPD_SendData(0x27);
+    EPD_SendData(0x01);
+
+    EPD_SendCmd(cmd);
     for (j = 0; j < HEIGHT; j++) {
         for (i = 0; i < WIDTH; i++) {
-            EPD_SendData(0xFF);
+            EPD_SendData(Image ? Image[i + j * WIDTH] : 0xFF);
         }
     }
+    EPD_SendBarrier();
+}
+
+// 刷新之后都把同一帧写进 0x26, 这样下一次局刷时 0x26 总是屏幕上的旧图
+void EPD_Clear() {
+    EPD_WriteRam(0x24, NULL);
     EPD_RefreshDisplay();
+    EPD_WriteRam(0x26, NULL);
 }
 
 void EPD_Display(UBYTE *Image) {
-    UWORD j,i;
-    EPD_SendCmd(0x24);
-    for (j = 0; j < HEIGHT; j++) {
-        for (i = 0; i < WIDTH; i++) {
-            EPD_SendData(Image[i + j * WIDTH]);
-        }
-    }
+    EPD_WriteRam(0x24, Image);
     EPD_RefreshDisplay();
+    EPD_WriteRam(0x26, Image);
 }
 
 void EPD_DisplayPart(UBYTE *Image)
 {
-    UWORD j,i;
-    EPD_SendCmd(0x24);
-    for (j = 0; j < HEIGHT; j++) {
-        for (i = 0; i < WIDTH; i++) {
-            EPD_SendData(Image[i + j * WIDTH]);
-        }
-    }
-
+    EPD_WriteRam(0x24, Image);
     EPD_RefreshDisplayPart();
+    EPD_WriteRam(0x26, Image);
 }
 
 void EPD_Sleep() {
@@ -231,5 +404,6 @@ void EPD_Sleep() {
     
     EPD_SendCmd(0x10);
     EPD_SendData(0x01);
+    EPD_SendBarrier();
     msleep(100);
 }
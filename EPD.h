@@ -28,6 +28,7 @@ static const int EPD_SCLK_PIN    = 11;
 static void EPD_Reset(void);
 static void EPD_SendCmd(UBYTE Reg);
 static void EPD_SendData(UBYTE Data);
+static void EPD_SendBarrier(void);
 static void EPD_WaitBusy(void);
 void EPD_RefreshDisplay(void);
 void EPD_RefreshDisplayPart(void);
@@ -35,6 +36,7 @@ void EPD_RefreshDisplayPart(void);
 UBYTE DEV_Hardware_Init(void);
 void DEV_Hardware_Exit(void);
 void EPD_init_full(void);
+void EPD_init_part(void);
 void EPD_Clear(void);
 void EPD_Display(UBYTE *Image);
 void EPD_DisplayPart(UBYTE *Image);
@@ -55,6 +55,27 @@ int SPI_TransferByte(uint8_t data)
     return rx;
 }
 
+// 连续写多个字节, buf 必须可 DMA (kmalloc)
+int SPI_Write(const uint8_t *buf, size_t len)
+{
+    if (!epd_spi_device) return -ENODEV;
+    return spi_write(epd_spi_device, buf, len);
+}
+
+// panic 时用: 总线锁、控制器和它的消息队列都空闲才返回 true.
+// 其它 CPU 已经停下, 这时 spi_sync 拿锁不会等, 短事务由控制器轮询完成
+bool SPI_Idle(void)
+{
+    struct spi_controller *ctlr;
+
+    if (!epd_spi_device) return false;
+    ctlr = epd_spi_device->controller;
+    return !ctlr->bus_lock_flag &&
+           !mutex_is_locked(&ctlr->bus_lock_mutex) &&
+           !mutex_is_locked(&ctlr->io_mutex) &&
+           !READ_ONCE(ctlr->busy) && !READ_ONCE(ctlr->cur_msg);
+}
+
 int spi_init(void) {
     // 注册SPI设备
     struct spi_controller *master = NULL;
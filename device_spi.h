@@ -6,5 +6,7 @@
 int spi_init(void);
 void spi_close(void);
 int SPI_TransferByte(uint8_t data);
+int SPI_Write(const uint8_t *buf, size_t len);
+bool SPI_Idle(void);
 
 #endif
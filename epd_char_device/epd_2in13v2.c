@@ -1,23 +1,29 @@
-
 /**
 * EPD driver
 **/
-#define EPD_2IN13_V2_WIDTH      122 
-#define EPD_2IN13_V2_HEIGHT     250 
-
-#define WIDTH ((EPD_2IN13_V2_WIDTH % 8 == 0)? (EPD_2IN13_V2_WIDTH / 8 ): (EPD_2IN13_V2_WIDTH / 8 + 1))
-#define HEIGHT (EPD_2IN13_V2_HEIGHT) 
-
-struct epd_dev {
-    struct spi_device *spi;
-    struct gpio_desc *gdc;
-    struct gpio_desc *grst;
-    struct gpio_desc *gbusy;
-    struct gpio_desc *gpwr;
-    struct cdev cdev;
-    dev_t devt;
-    uint8_t * display_buf;
-};
+#include <linux/module.h>
+#include <linux/delay.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+
+#include "epd_2in13v2.h"
+#include "../lib/font/font12.c"
+
+#define EPD_SPI_SPEED_HZ 500000
+#define EPD_STAGE_SIZE   128    // 参数字节暂存区, 够放一整张 70 字节 LUT
+#define EPD_BUSY_POLL_MS 10     // 没有 BUSY 中断时的轮询间隔
+#define EPD_RAM_Y_START  0x127  // 数据输入模式 0x01 下 Y 从 0x127 递减到 0x2E
+
+static unsigned int busy_timeout_ms = 5000;
+module_param(busy_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(busy_timeout_ms, "Give up waiting for BUSY after this many ms");
+
+const struct epd_rect epd_full_rect = { 0, 0, WIDTH, HEIGHT };
+EXPORT_SYMBOL_GPL(epd_full_rect);
 
 const uint8_t EPD_2IN13_V2_lut_full_update[]= {
     0x80,0x60,0x40,0x00,0x00,0x00,0x00,             //LUT0: BB:     VS 0 ~7
@@ -37,6 +43,24 @@ const uint8_t EPD_2IN13_V2_lut_full_update[]= {
     0x15,0x41,0xA8,0x32,0x30,0x0A,
 };
 
+const uint8_t EPD_2IN13_V2_lut_partial_update[]= { //20 bytes
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,             //LUT0: BB:     VS 0 ~7
+    0x80,0x00,0x00,0x00,0x00,0x00,0x00,             //LUT1: BW:     VS 0 ~7
+    0x40,0x00,0x00,0x00,0x00,0x00,0x00,             //LUT2: WB:     VS 0 ~7
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,             //LUT3: WW:     VS 0 ~7
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,             //LUT4: VCOM:   VS 0 ~7
+
+    0x0A,0x00,0x00,0x00,0x00,                       // TP0 A~D RP0
+    0x00,0x00,0x00,0x00,0x00,                       // TP1 A~D RP1
+    0x00,0x00,0x00,0x00,0x00,                       // TP2 A~D RP2
+    0x00,0x00,0x00,0x00,0x00,                       // TP3 A~D RP3
+    0x00,0x00,0x00,0x00,0x00,                       // TP4 A~D RP4
+    0x00,0x00,0x00,0x00,0x00,                       // TP5 A~D RP5
+    0x00,0x00,0x00,0x00,0x00,                       // TP6 A~D RP6
+
+    0x15,0x41,0xA8,0x32,0x30,0x0A,
+};
+
 static void EPD_Reset(struct epd_dev *epd) {
     pr_info("== EPD Hardware Reset ==");
     gpiod_set_value(epd->grst, 1);
@@ -54,7 +78,7 @@ static uint8_t EPD_TransferByte(struct epd_dev *epd, uint8_t data)
         .tx_buf = &data,
         .rx_buf = &rx,
         .len = 1,
-        .speed_hz = 500000,  // 20MHz
+        .speed_hz = EPD_SPI_SPEED_HZ,
         .bits_per_word = 8,
 	.cs_change = 0,  // CS keep
     };
@@ -63,50 +87,243 @@ static uint8_t EPD_TransferByte(struct epd_dev *epd, uint8_t data)
     spi_message_init(&msg);
     spi_message_add_tail(&xfer, &msg);
     spi_sync(epd->spi, &msg);
+    epd->stats.transfers++;
     
     return rx;
 }
 
+// 只在电平真正变化时才切 DC
+static void EPD_SetDC(struct epd_dev *epd, int dc)
+{
+    if (epd->dc != dc) {
+        gpiod_set_value(epd->gdc, dc);
+        epd->dc = dc;
+    }
+}
+
+// 按控制器单次传输上限拆分, buf 必须可 DMA (kmalloc)
+static void EPD_Write(struct epd_dev *epd, const uint8_t *buf, size_t len)
+{
+    size_t max_len = spi_max_transfer_size(epd->spi);
+
+    while (len) {
+        struct spi_transfer xfer = {
+            .tx_buf = buf,
+            .len = min(len, max_len),
+            .speed_hz = EPD_SPI_SPEED_HZ,
+            .bits_per_word = 8,
+        };
+
+        spi_sync_transfer(epd->spi, &xfer, 1);
+        epd->stats.transfers++;
+        buf += xfer.len;
+        len -= xfer.len;
+    }
+}
+
+// 把暂存的参数字节作为一次传输发出; 也可作为显式屏障调用
+static void EPD_SendBarrier(struct epd_dev *epd)
+{
+    if (!epd->stage_len)
+        return;
+    EPD_SetDC(epd, 1); // data
+    EPD_Write(epd, epd->stage_buf, epd->stage_len);
+    epd->stage_len = 0;
+}
+
 static void EPD_SendCmd(struct epd_dev *epd, uint8_t cmd) {
-    gpiod_set_value(epd->gdc, 0); // cmd
+    EPD_SendBarrier(epd);
+    EPD_SetDC(epd, 0); // cmd
     EPD_TransferByte(epd, cmd);
+    epd->stats.cmds++;
 }
 
+// 参数字节先进暂存区, 下一条命令 / WaitBusy / 屏障时一起发出
 static void EPD_SendData(struct epd_dev *epd, uint8_t dat) {
-    gpiod_set_value(epd->gdc, 1); // data
-    EPD_TransferByte(epd, dat);
+    if (epd->stage_len == EPD_STAGE_SIZE)
+        EPD_SendBarrier(epd);
+    epd->stage_buf[epd->stage_len++] = dat;
+    epd->stats.data_bytes++;
+}
+
+// 批量写 RAM: DC 只切一次
+static void EPD_SendDataBuf(struct epd_dev *epd, const uint8_t *buf, size_t len)
+{
+    EPD_SendBarrier(epd);
+    EPD_SetDC(epd, 1); // data
+    EPD_Write(epd, buf, len);
+    epd->stats.data_bytes += len;
+}
+
+static irqreturn_t EPD_BusyIrq(int irq, void *data)
+{
+    struct epd_dev *epd = data;
+
+    complete(&epd->busy_done);
+    return IRQ_HANDLED;
+}
+
+// BUSY 下降沿中断; 拿不到中断号就退回轮询
+static void EPD_SetupBusyIrq(struct epd_dev *epd, struct device *dev)
+{
+    int irq, ret;
+
+    init_completion(&epd->busy_done);
+    epd->busy_irq = 0;
+
+    irq = gpiod_to_irq(epd->gbusy);
+    if (irq <= 0) {
+        dev_info(dev, "no irq for busy gpio, polling\n");
+        return;
+    }
+    ret = devm_request_irq(dev, irq, EPD_BusyIrq, IRQF_TRIGGER_FALLING,
+                           "epd-busy", epd);
+    if (ret) {
+        dev_warn(dev, "failed to request busy irq (%d), polling\n", ret);
+        return;
+    }
+    epd->busy_irq = irq;
 }
 
 static void EPD_WaitBusy(struct epd_dev *epd) {
-    uint8_t timeout = 50;
+    unsigned long deadline;
+    long left;
+
+    EPD_SendBarrier(epd);
+
+    // 先清掉上一次残留的完成量, 再看电平, 下降沿不会丢
+    reinit_completion(&epd->busy_done);
+    deadline = jiffies + msecs_to_jiffies(busy_timeout_ms);
     while(gpiod_get_value(epd->gbusy) == 1) {      //LOW: idle, HIGH: busy
-	timeout--;
-        msleep(100);
-        //pr_info("e-Paper busy\r\n");
-	if(timeout <= 0) {
+        left = (long)(deadline - jiffies);
+	if(left <= 0) {
 		pr_debug("EPD wait busy time out. Force release in software\r\n");
 		break;
 	}
+        if (epd->busy_irq)
+            wait_for_completion_timeout(&epd->busy_done, left);
+        else
+            msleep(EPD_BUSY_POLL_MS);
     }
     pr_info("e-Paper busy release\r\n");
 }
 
+// 切换全刷 / 局刷波形, 已经是目标 LUT 时不重复下发
+static void EPD_LoadLut(struct epd_dev *epd, enum epd_refresh mode)
+{
+    const uint8_t *lut;
+    uint8_t count;
+
+    if (epd->lut_mode == mode)
+        return;
+
+    if (mode == EPD_REFRESH_PARTIAL) {
+        lut = EPD_2IN13_V2_lut_partial_update;
+        EPD_SendCmd(epd, 0x2C); //VCOM Voltage
+        EPD_SendData(epd, 0x26);
+        EPD_WaitBusy(epd);
+    } else {
+        lut = EPD_2IN13_V2_lut_full_update;
+        EPD_SendCmd(epd, 0x2C); //VCOM Voltage
+        EPD_SendData(epd, 0x55);
+    }
+
+    EPD_SendCmd(epd, 0x32);
+    for(count = 0; count < 70; count++) {
+        EPD_SendData(epd, lut[count]);
+    }
+
+    EPD_SendCmd(epd, 0x37); // display option, 局刷打开 RAM ping-pong
+    EPD_SendData(epd, 0x00);
+    EPD_SendData(epd, 0x00);
+    EPD_SendData(epd, 0x00);
+    EPD_SendData(epd, 0x00);
+    EPD_SendData(epd, mode == EPD_REFRESH_PARTIAL ? 0x40 : 0x00);
+    EPD_SendData(epd, 0x00);
+    EPD_SendData(epd, 0x00);
+
+    if (mode == EPD_REFRESH_PARTIAL) {
+        EPD_SendCmd(epd, 0x22);
+        EPD_SendData(epd, 0xC0); // enable clock + analog
+        EPD_SendCmd(epd, 0x20);
+        EPD_WaitBusy(epd);
+    }
+
+    EPD_SendCmd(epd, 0x3C); //BorderWavefrom
+    EPD_SendData(epd, mode == EPD_REFRESH_PARTIAL ? 0x01 : 0x03);
+
+    epd->lut_mode = mode;
+}
+
 static void EPD_RefreshDisplay(struct epd_dev *epd) {
+    EPD_LoadLut(epd, EPD_REFRESH_FULL);
     EPD_SendCmd(epd, 0x22);
     EPD_SendData(epd, 0xC7);  // 0xC7:全刷, 0x0C:局刷
     EPD_SendCmd(epd, 0x20);
     EPD_WaitBusy(epd);
 }
 
-static void EPD_Clear(struct epd_dev *epd) {
-    uint8_t j,i;
-    EPD_SendCmd(epd, 0x24);
-    for (j = 0; j < HEIGHT; j++) {
-        for (i = 0; i < WIDTH; i++) {
-            EPD_SendData(epd, 0xFF);
-        }
+static void EPD_RefreshDisplayPart(struct epd_dev *epd) {
+    EPD_LoadLut(epd, EPD_REFRESH_PARTIAL);
+    EPD_SendCmd(epd, 0x22);
+    EPD_SendData(epd, 0x0C);  // 0xC7:全刷, 0x0C:局刷
+    EPD_SendCmd(epd, 0x20);
+    EPD_WaitBusy(epd);
+}
+
+// 设置 RAM 窗口 (0x44/0x45) 并把地址计数器移到窗口起点 (0x4E/0x4F)
+static void EPD_SetWindow(struct epd_dev *epd, const struct epd_rect *r)
+{
+    uint16_t ys = EPD_RAM_Y_START - r->y0;
+    uint16_t ye = EPD_RAM_Y_START - (r->y1 - 1);
+
+    EPD_SendCmd(epd, 0x44); //set Ram-X address start/end position
+    EPD_SendData(epd, r->x0);
+    EPD_SendData(epd, r->x1 - 1);
+
+    EPD_SendCmd(epd, 0x45); //set Ram-Y address start/end position
+    EPD_SendData(epd, ys & 0xFF);
+    EPD_SendData(epd, ys >> 8);
+    EPD_SendData(epd, ye & 0xFF);
+    EPD_SendData(epd, ye >> 8);
+
+    EPD_SendCmd(epd, 0x4E); // RAM x address count
+    EPD_SendData(epd, r->x0);
+    EPD_SendCmd(epd, 0x4F); // RAM y address count
+    EPD_SendData(epd, ys & 0xFF);
+    EPD_SendData(epd, ys >> 8);
+}
+
+// 把 src 中 r 范围内的数据写入 RAM (cmd = 0x24 新图 / 0x26 旧图)
+static void EPD_WriteRam(struct epd_dev *epd, uint8_t cmd,
+                         const uint8_t *src, const struct epd_rect *r)
+{
+    size_t w = r->x1 - r->x0;
+    size_t len = 0;
+    uint16_t y;
+
+    EPD_SetWindow(epd, r);
+    EPD_SendCmd(epd, cmd);
+
+    // 整行宽度时显存本身就是连续的
+    if (w == WIDTH) {
+        EPD_SendDataBuf(epd, src + r->y0 * WIDTH, (r->y1 - r->y0) * WIDTH);
+        return;
+    }
+    for (y = r->y0; y < r->y1; y++) {
+        memcpy(epd->xfer_buf + len, src + y * WIDTH + r->x0, w);
+        len += w;
     }
+    EPD_SendDataBuf(epd, epd->xfer_buf, len);
+}
+
+// 整屏刷白, 两块 RAM 和影子帧都置白. 之后整帧都要重新提交
+static void EPD_Clear(struct epd_dev *epd) {
+    memset(epd->xfer_buf, 0xFF, WIDTH * HEIGHT);
+    EPD_WriteRam(epd, 0x24, epd->xfer_buf, &epd_full_rect);
     EPD_RefreshDisplay(epd);
+    EPD_WriteRam(epd, 0x26, epd->xfer_buf, &epd_full_rect);
+    memset(epd->shadow_buf, 0xFF, WIDTH * HEIGHT);
 }
 
 // 全刷参数
@@ -165,6 +382,7 @@ static void EPD_init_full(struct epd_dev *epd) {
     for(count = 0; count < 70; count++) {
         EPD_SendData(epd, EPD_2IN13_V2_lut_full_update[count]);
     }
+    epd->lut_mode = EPD_REFRESH_FULL;
 
     EPD_SendCmd(epd, 0x4E);   // set RAM x address count to 0;
     EPD_SendData(epd, 0x00);
@@ -174,58 +392,1029 @@ static void EPD_init_full(struct epd_dev *epd) {
     EPD_WaitBusy(epd);
 }
 
+static bool EPD_RectEmpty(const struct epd_rect *r)
+{
+    return r->x0 >= r->x1 || r->y0 >= r->y1;
+}
+
+static uint32_t EPD_RectArea(const struct epd_rect *r)
+{
+    return EPD_RectEmpty(r) ? 0 : (r->x1 - r->x0) * (r->y1 - r->y0);
+}
+
+// 重叠或共边
+static bool EPD_RectsTouch(const struct epd_rect *a, const struct epd_rect *b)
+{
+    return a->x0 <= b->x1 && b->x0 <= a->x1 &&
+           a->y0 <= b->y1 && b->y0 <= a->y1;
+}
+
+static void EPD_UnionRect(struct epd_rect *r, const struct epd_rect *o)
+{
+    if (EPD_RectEmpty(o))
+        return;
+    if (EPD_RectEmpty(r)) {
+        *r = *o;
+        return;
+    }
+    r->x0 = min(r->x0, o->x0);
+    r->y0 = min(r->y0, o->y0);
+    r->x1 = max(r->x1, o->x1);
+    r->y1 = max(r->y1, o->y1);
+}
+
+void EPD_DamageRect(struct epd_damage *d, const struct epd_rect *r)
+{
+    struct epd_rect u = *r;
+    struct epd_rect m;
+    uint32_t cost, best_cost;
+    int i, best;
+
+    u.x1 = min_t(uint16_t, u.x1, WIDTH);
+    u.y1 = min_t(uint16_t, u.y1, HEIGHT);
+    if (EPD_RectEmpty(&u))
+        return;
+
+restart:
+    // 合并后可能又碰到别的矩形, 所以从头再扫
+    for (i = 0; i < d->count; i++) {
+        if (EPD_RectsTouch(&d->rect[i], &u)) {
+            EPD_UnionRect(&u, &d->rect[i]);
+            d->rect[i] = d->rect[--d->count];
+            goto restart;
+        }
+    }
+    if (d->count < EPD_MAX_DAMAGE) {
+        d->rect[d->count++] = u;
+        return;
+    }
+
+    best = 0;
+    best_cost = U32_MAX;
+    for (i = 0; i < d->count; i++) {
+        m = d->rect[i];
+        EPD_UnionRect(&m, &u);
+        cost = EPD_RectArea(&m) - EPD_RectArea(&d->rect[i]);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best = i;
+        }
+    }
+    EPD_UnionRect(&u, &d->rect[best]);
+    d->rect[best] = d->rect[--d->count];
+    goto restart;
+}
+EXPORT_SYMBOL_GPL(EPD_DamageRect);
+
+void EPD_Damage(struct epd_dev *epd, const struct epd_rect *r)
+{
+    EPD_DamageRect(&epd->damage, r);
+}
+EXPORT_SYMBOL_GPL(EPD_Damage);
+
+// 像素坐标 (闭区间) 转成字节列矩形, 越界部分裁掉, 全部越界返回 false
+bool EPD_PixelRect(int px0, int py0, int px1, int py1, struct epd_rect *r)
+{
+    px0 = max(px0, 0);
+    py0 = max(py0, 0);
+    px1 = min(px1, EPD_2IN13_V2_WIDTH - 1);
+    py1 = min(py1, EPD_2IN13_V2_HEIGHT - 1);
+    if (px0 > px1 || py0 > py1)
+        return false;
+
+    *r = (struct epd_rect){ px0 / 8, py0, px1 / 8 + 1, py1 + 1 };
+    return true;
+}
+EXPORT_SYMBOL_GPL(EPD_PixelRect);
+
+// 显存中 [off, off + len) 这段字节: 落在一行内时取准确的字节列, 跨行时取整行
+bool EPD_ByteRect(unsigned long off, size_t len, struct epd_rect *r)
+{
+    unsigned long end;
+
+    if (!len || off >= WIDTH * HEIGHT)
+        return false;
+    end = min_t(unsigned long, off + len, WIDTH * HEIGHT);
+    *r = (struct epd_rect){ 0, off / WIDTH, WIDTH, DIV_ROUND_UP(end, WIDTH) };
+    if (r->y1 - r->y0 == 1) {
+        r->x0 = off % WIDTH;
+        r->x1 = r->x0 + (end - off);
+    }
+    return true;
+}
+EXPORT_SYMBOL_GPL(EPD_ByteRect);
+
+static void EPD_DamageClear(struct epd_dev *epd)
+{
+    epd->damage.count = 0;
+}
+
+const uint8_t epd_row_ones[WIDTH] = {
+    [0 ... WIDTH - 1] = 0xFF,
+};
+EXPORT_SYMBOL_GPL(epd_row_ones);
+const uint8_t epd_row_zeros[WIDTH];
+EXPORT_SYMBOL_GPL(epd_row_zeros);
+
+// 把 w x h 的 1bpp 源图 (每行 stride 字节) 贴到 buf 的像素 (x, y), 越界部分裁掉.
+// 按源字节移位后与目标的一到两个字节做掩码合并. 贴到的区域写进 r, 全部越界返回 false
+bool EPD_BlitBits(uint8_t *buf, unsigned int x, unsigned int y,
+                  unsigned int w, unsigned int h,
+                  const uint8_t *src, unsigned int stride,
+                  struct epd_rect *r)
+{
+    unsigned int shift = x % 8;
+    unsigned int row, i, nbits;
+    uint8_t *dst;
+    uint8_t mask, v;
+
+    if (x >= EPD_2IN13_V2_WIDTH || y >= EPD_2IN13_V2_HEIGHT || !w || !h)
+        return false;
+    w = min(w, EPD_2IN13_V2_WIDTH - x);
+    h = min(h, EPD_2IN13_V2_HEIGHT - y);
+
+    for (row = 0; row < h; row++) {
+        dst = buf + (y + row) * WIDTH + x / 8;
+        for (i = 0; i * 8 < w; i++) {
+            nbits = min(8u, w - i * 8);
+            mask = 0xFF << (8 - nbits);
+            v = src[row * stride + i] & mask;
+            dst[i] = (dst[i] & ~(mask >> shift)) | (v >> shift);
+            if (shift && (uint8_t)(mask << (8 - shift)))
+                dst[i + 1] = (dst[i + 1] & ~(uint8_t)(mask << (8 - shift))) |
+                             (uint8_t)(v << (8 - shift));
+        }
+    }
+    return EPD_PixelRect(x, y, x + w - 1, y + h - 1, r);
+}
+EXPORT_SYMBOL_GPL(EPD_BlitBits);
+
+// 贴到画布上并记为脏区
+void EPD_Blit(struct epd_dev *epd, unsigned int x, unsigned int y,
+              unsigned int w, unsigned int h,
+              const uint8_t *src, unsigned int stride)
+{
+    struct epd_rect r;
+
+    if (EPD_BlitBits(epd->display_buf, x, y, w, h, src, stride, &r))
+        EPD_Damage(epd, &r);
+}
+EXPORT_SYMBOL_GPL(EPD_Blit);
+
+// 与影子帧按字异或比较, 把 r 收紧到真正变化的字节; 没有变化返回 false
+static bool EPD_DiffRect(struct epd_dev *epd, const uint8_t *src,
+                         struct epd_rect *r, struct epd_diff *diff)
+{
+    struct epd_rect d = { WIDTH, HEIGHT, 0, 0 };
+    const unsigned long *a, *b;
+    unsigned long word;
+    uint8_t xor;
+    uint16_t x, y;
+
+    BUILD_BUG_ON(WIDTH % sizeof(unsigned long));
+
+    for (y = r->y0; y < r->y1; y++) {
+        a = (const unsigned long *)(src + y * WIDTH);
+        b = (const unsigned long *)(epd->shadow_buf + y * WIDTH);
+        word = 0;
+        for (x = 0; x < WIDTH / sizeof(unsigned long); x++)
+            word |= a[x] ^ b[x];
+        if (!word)
+            continue;
+
+        for (x = r->x0; x < r->x1; x++) {
+            xor = src[y * WIDTH + x] ^ epd->shadow_buf[y * WIDTH + x];
+            if (xor) {
+                d.x0 = min(d.x0, x);
+                d.x1 = max_t(uint16_t, d.x1, x + 1);
+                d.y0 = min(d.y0, y);
+                d.y1 = y + 1;
+                diff->bytes++;
+                diff->flips[y * EPD_GHOST_BANDS / HEIGHT] += hweight8(xor);
+            }
+        }
+    }
+    if (EPD_RectEmpty(&d))
+        return false;
+    *r = d;
+    return true;
+}
+
+// 按变化比例和重影预算决定本帧全刷还是局刷
+static enum epd_refresh EPD_ChooseRefresh(struct epd_dev *epd,
+                                          const struct epd_diff *diff)
+{
+    struct epd_policy *p = &epd->policy;
+    struct epd_refresh_stats *st = &epd->rstats;
+    unsigned int budget = READ_ONCE(p->ghost_budget);
+    int i;
+
+    if (st->partials_since_full >= READ_ONCE(p->max_partials))
+        return EPD_REFRESH_FULL;
+    if (diff->bytes * 100 >= READ_ONCE(p->full_diff_pct) * WIDTH * HEIGHT)
+        return EPD_REFRESH_FULL;
+    for (i = 0; i < EPD_GHOST_BANDS; i++) {
+        if (st->band_flips[i] + diff->flips[i] > budget)
+            return EPD_REFRESH_FULL;
+    }
+    return EPD_REFRESH_PARTIAL;
+}
+
+static void EPD_AccountRefresh(struct epd_dev *epd, enum epd_refresh mode,
+                               const struct epd_diff *diff)
+{
+    struct epd_refresh_stats *st = &epd->rstats;
+    int i;
+
+    if (mode == EPD_REFRESH_FULL) {
+        st->full++;
+        st->partials_since_full = 0;
+        memset(st->band_flips, 0, sizeof(st->band_flips));
+        return;
+    }
+    st->partial++;
+    st->partials_since_full++;
+    for (i = 0; i < EPD_GHOST_BANDS; i++)
+        st->band_flips[i] += diff->flips[i];
+}
+
+// 局刷攒够了就在空闲时做清理全刷; 每次提交都把定时往后推
+static void EPD_ScheduleCleanup(struct epd_dev *epd)
+{
+    unsigned int idle_ms = READ_ONCE(epd->policy.idle_ms);
+
+    if (!idle_ms || !epd->rstats.partials_since_full ||
+        epd->rstats.partials_since_full < READ_ONCE(epd->policy.cleanup_partials))
+        return;
+    mod_delayed_work(epd->wq, &epd->cleanup_work, msecs_to_jiffies(idle_ms));
+}
+
+static void EPD_CleanupWork(struct work_struct *work)
+{
+    struct epd_dev *epd = container_of(to_delayed_work(work),
+                                       struct epd_dev, cleanup_work);
+    struct epd_diff none = { 0 };
+
+    mutex_lock(&epd->hw_lock);
+    // RAM 0x24 与影子帧一致, 直接全刷即可消除重影.
+    // 有暂存帧时 0x24 里是还没到点的内容, 不能刷
+    if (epd->rstats.partials_since_full &&
+        READ_ONCE(epd->stage.state) == EPD_STAGE_IDLE) {
+        EPD_RefreshDisplay(epd);
+        EPD_AccountRefresh(epd, EPD_REFRESH_FULL, &none);
+        epd->rstats.cleanups++;
+    }
+    mutex_unlock(&epd->hw_lock);
+}
+
+static void EPD_CopyRect(uint8_t *dst, const uint8_t *src, const struct epd_rect *r)
+{
+    uint16_t y;
+
+    for (y = r->y0; y < r->y1; y++)
+        memcpy(dst + y * WIDTH + r->x0, src + y * WIDTH + r->x0, r->x1 - r->x0);
+}
+
+// 上传一帧的脏区: 只有变化的字节写进 0x24, 并预先装好要用的 LUT,
+// 之后触发刷新只需 0x22/0x20. 没有变化时不上传, 返回 false.
+// ev 不为空时填入上传完成的时间. 调用者持有 hw_lock
+static bool EPD_Upload(struct epd_dev *epd, const uint8_t *src,
+                       const struct epd_damage *d, enum epd_refresh mode,
+                       struct epd_upload *up, struct epd_event *ev)
+{
+    int i;
+
+    up->n = 0;
+    memset(&up->diff, 0, sizeof(up->diff));
+    for (i = 0; i < d->count; i++) {
+        up->rects[up->n] = d->rect[i];
+        if (EPD_DiffRect(epd, src, &up->rects[up->n], &up->diff))
+            up->n++;
+    }
+    if (!up->n) {
+        if (ev) {
+            ev->upload_ns = ev->refresh_ns = ktime_get_ns();
+            ev->flags |= EPD_EVENT_SKIPPED;
+        }
+        return false;
+    }
+
+    if (mode == EPD_REFRESH_AUTO)
+        mode = EPD_ChooseRefresh(epd, &up->diff);
+    up->mode = mode;
+
+    for (i = 0; i < up->n; i++)
+        EPD_WriteRam(epd, 0x24, src, &up->rects[i]);
+    EPD_LoadLut(epd, mode);
+    EPD_SendBarrier(epd);
+    if (ev)
+        ev->upload_ns = ktime_get_ns();
+    return true;
+}
+
+// 触发刷新, 刷完后把同样的区域写进 0x26 和影子帧, 这样下一次局刷时
+// 0x26 总是屏幕上的旧图. 调用者持有 hw_lock
+static void EPD_Trigger(struct epd_dev *epd, const uint8_t *src,
+                        const struct epd_upload *up, struct epd_event *ev)
+{
+    int i;
+
+    if (up->mode == EPD_REFRESH_PARTIAL)
+        EPD_RefreshDisplayPart(epd);
+    else
+        EPD_RefreshDisplay(epd);
+    EPD_AccountRefresh(epd, up->mode, &up->diff);
+    if (ev) {
+        ev->refresh_ns = ktime_get_ns();
+        if (up->mode == EPD_REFRESH_FULL)
+            ev->flags |= EPD_EVENT_FULL;
+    }
+
+    for (i = 0; i < up->n; i++) {
+        EPD_WriteRam(epd, 0x26, src, &up->rects[i]);
+        EPD_CopyRect(epd->shadow_buf, src, &up->rects[i]);
+    }
+    EPD_ScheduleCleanup(epd);
+}
+
+// 上传并立即刷新. 没有变化时不刷新, 返回 false. 调用者持有 hw_lock
+static bool EPD_Commit(struct epd_dev *epd, const uint8_t *src,
+                       const struct epd_damage *d, enum epd_refresh mode,
+                       struct epd_event *ev)
+{
+    struct epd_upload up;
+
+    if (!EPD_Upload(epd, src, d, mode, &up, ev))
+        return false;
+    EPD_Trigger(epd, src, &up, ev);
+    return true;
+}
+
+/*------------------------- 完成事件 -------------------------*/
+static void EPD_PostEvent(struct epd_dev *epd, const struct epd_event *ev)
+{
+    spin_lock(&epd->event_lock);
+    epd->events[epd->event_count % EPD_EVENT_RING] = *ev;
+    epd->event_count++;
+    spin_unlock(&epd->event_lock);
+
+    wake_up_interruptible_poll(&epd->event_wait, EPOLLIN | EPOLLPRI);
+    kill_fasync(&epd->fasync, SIGIO, POLL_PRI);
+    if (epd->frame_done)
+        epd->frame_done(epd, ev);
+}
+
+// 取 *next 处的事件并前移; 落后超过环长的读者跳到最旧的一条.
+// 没有新事件返回 false
+bool EPD_ReadEvent(struct epd_dev *epd, uint32_t *next,
+                   struct epd_event *ev)
+{
+    bool ret = false;
+
+    spin_lock(&epd->event_lock);
+    if (epd->event_count - *next > EPD_EVENT_RING)
+        *next = epd->event_count - EPD_EVENT_RING;
+    if (*next != epd->event_count) {
+        *ev = epd->events[*next % EPD_EVENT_RING];
+        (*next)++;
+        ret = true;
+    }
+    spin_unlock(&epd->event_lock);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(EPD_ReadEvent);
+
+bool EPD_EventPending(struct epd_dev *epd, uint32_t next)
+{
+    return READ_ONCE(epd->event_count) != next;
+}
+EXPORT_SYMBOL_GPL(EPD_EventPending);
+
+/*------------------------- 帧信箱 -------------------------*/
+// 把画布和脏区拍成一帧放进信箱, 不会阻塞: 已有待刷帧时直接覆盖它,
+// 脏区取并集, 优先级取最高. 返回这次提交的序号. 调用者持有 lock
+uint32_t EPD_SubmitFrame(struct epd_dev *epd, enum epd_refresh mode,
+                         unsigned int prio)
+{
+    struct epd_frame *frame = epd->pending;
+    u64 now = ktime_get_ns();
+    int i;
+
+    if (frame) {
+        epd->fstats.coalesced++;
+    } else {
+        frame = list_first_entry(&epd->free_frames, struct epd_frame, node);
+        list_del(&frame->node);
+        frame->damage.count = 0;
+        frame->clear = false;
+        frame->prio = prio;
+        memset(frame->class_queued_ns, 0, sizeof(frame->class_queued_ns));
+        epd->pending = frame;
+    }
+
+    memcpy(frame->buf, epd->display_buf, WIDTH * HEIGHT);
+    for (i = 0; i < epd->damage.count; i++)
+        EPD_DamageRect(&frame->damage, &epd->damage.rect[i]);
+    // 全刷波形本身就会复位像素, 只有明确要求时才先刷白
+    frame->clear |= mode == EPD_REFRESH_CLEAR;
+    frame->mode = mode == EPD_REFRESH_CLEAR ? EPD_REFRESH_FULL : mode;
+    frame->seq = ++epd->fstats.submitted;
+    frame->queued_ns = now;
+    frame->prio = max(frame->prio, prio);
+    if (!frame->class_queued_ns[prio])
+        frame->class_queued_ns[prio] = now;
+    epd->qstats[prio].submitted++;
+    EPD_DamageClear(epd);
+
+    // 刷新线程可能正为限速等待, 让它马上重新看一次
+    mod_delayed_work(epd->wq, &epd->refresh_work, 0);
+    return frame->seq;
+}
+EXPORT_SYMBOL_GPL(EPD_SubmitFrame);
+
+// 令牌桶: 每 refresh_interval_ms 攒一次刷新, 最多攒 refresh_burst 次.
+// 紧急帧不受限, 有令牌时照样消耗. 拿不到时返回 false, *wait 为还要等的 jiffies.
+// 调用者持有 lock
+static bool EPD_TakeToken(struct epd_dev *epd, unsigned int prio, unsigned long *wait)
+{
+    unsigned int interval = READ_ONCE(epd->policy.refresh_interval_ms);
+    unsigned int burst = max(READ_ONCE(epd->policy.refresh_burst), 1u);
+    u64 now = ktime_get_ns();
+    u64 step, n;
+
+    if (!interval)
+        return true;
+
+    step = (u64)interval * NSEC_PER_MSEC;
+    n = div64_u64(now - epd->token_ns, step);
+    if (epd->tokens + n >= burst) {
+        epd->tokens = burst;
+        epd->token_ns = now;
+    } else {
+        epd->tokens += n;
+        epd->token_ns += n * step;
+    }
+
+    if (epd->tokens) {
+        epd->tokens--;
+        return true;
+    }
+    if (prio == EPD_PRIO_URGENT)
+        return true;
+    *wait = nsecs_to_jiffies(epd->token_ns + step - now) + 1;
+    epd->throttled++;
+    return false;
+}
+
+static void EPD_AccountQos(struct epd_dev *epd, const struct epd_frame *frame,
+                           u64 done_ns)
+{
+    struct epd_qos_stats *qs;
+    u64 lat;
+    int i;
+
+    for (i = 0; i < EPD_PRIO_COUNT; i++) {
+        if (!frame->class_queued_ns[i])
+            continue;
+        qs = &epd->qstats[i];
+        lat = done_ns - frame->class_queued_ns[i];
+        qs->displayed++;
+        qs->latency_total_ns += lat;
+        qs->latency_max_ns = max(qs->latency_max_ns, lat);
+    }
+}
+
+// 面板空闲时总是取信箱里最新的那一帧; 超出刷新速率的非紧急帧留在信箱里,
+// 等令牌时还能继续被合并, 紧急帧到来时直接带着它们一起刷
+static void EPD_RefreshWork(struct work_struct *work)
+{
+    struct epd_dev *epd = container_of(to_delayed_work(work),
+                                       struct epd_dev, refresh_work);
+    struct epd_frame *frame;
+    struct epd_event ev;
+    unsigned long wait;
+
+    for (;;) {
+        mutex_lock(&epd->lock);
+        // 暂存帧提交之前信箱不动, 提交后会重新排这个 work
+        frame = epd->stage.state == EPD_STAGE_IDLE ? epd->pending : NULL;
+        if (frame && !EPD_TakeToken(epd, frame->prio, &wait)) {
+            mod_delayed_work(epd->wq, &epd->refresh_work, wait);
+            frame = NULL;
+        }
+        if (frame)
+            epd->pending = NULL;
+        mutex_unlock(&epd->lock);
+        if (!frame)
+            break;
+        // 信箱空了, 写者可以提交下一帧 (POLLOUT)
+        wake_up_interruptible_poll(&epd->event_wait, EPOLLOUT);
+
+        ev = (struct epd_event){
+            .seq = frame->seq,
+            .queued_ns = frame->queued_ns,
+        };
+
+        mutex_lock(&epd->hw_lock);
+        if (frame->clear) {
+            // 先刷白再整帧上传
+            EPD_Clear(epd);
+            frame->damage.rect[0] = epd_full_rect;
+            frame->damage.count = 1;
+        }
+        EPD_Commit(epd, frame->buf, &frame->damage, frame->mode, &ev);
+        mutex_unlock(&epd->hw_lock);
+
+        mutex_lock(&epd->lock);
+        list_add_tail(&frame->node, &epd->free_frames);
+        epd->fstats.displayed++;
+        EPD_AccountQos(epd, frame, ev.refresh_ns);
+        mutex_unlock(&epd->lock);
+
+        EPD_PostEvent(epd, &ev);
+    }
+}
+
+/*------------------------- 暂存与定时提交 -------------------------*/
+// 把画布 (连同信箱里还没刷的旧快照) 的脏区写进 RAM 0x24, 先不刷新.
+// owner 记下暂存者, 给 EPD_AbortStage 用. 返回这一帧的序号
+int EPD_StageFrame(struct epd_dev *epd, enum epd_refresh mode, const void *owner)
+{
+    struct epd_stage *st = &epd->stage;
+    struct epd_damage d = { 0 };
+    struct epd_frame *frame;
+    int i;
+
+    // 暂存只上传不刷新, 刷白做不到, 按全刷处理
+    if (mode == EPD_REFRESH_CLEAR)
+        mode = EPD_REFRESH_FULL;
+
+    mutex_lock(&epd->lock);
+    if (st->state != EPD_STAGE_IDLE) {
+        mutex_unlock(&epd->lock);
+        return -EBUSY;
+    }
+    st->state = EPD_STAGE_UPLOADING;
+    st->owner = owner;
+
+    // 待刷帧是画布更早的快照, 并进暂存帧
+    frame = epd->pending;
+    if (frame) {
+        d = frame->damage;
+        epd->pending = NULL;
+        list_add_tail(&frame->node, &epd->free_frames);
+        epd->fstats.coalesced++;
+    }
+    for (i = 0; i < epd->damage.count; i++)
+        EPD_DamageRect(&d, &epd->damage.rect[i]);
+    EPD_DamageClear(epd);
+    memcpy(st->buf, epd->display_buf, WIDTH * HEIGHT);
+    st->ev = (struct epd_event){
+        .seq = ++epd->fstats.submitted,
+        .flags = EPD_EVENT_STAGED,
+        .queued_ns = ktime_get_ns(),
+    };
+    mutex_unlock(&epd->lock);
+
+    // 正在刷的帧结束后才轮到这里, 比较基准是它刷完后的影子帧
+    mutex_lock(&epd->hw_lock);
+    st->uploaded = EPD_Upload(epd, st->buf, &d, mode, &st->up, &st->ev);
+    mutex_unlock(&epd->hw_lock);
+
+    mutex_lock(&epd->lock);
+    st->state = EPD_STAGE_READY;
+    mutex_unlock(&epd->lock);
+    return st->ev.seq;
+}
+EXPORT_SYMBOL_GPL(EPD_StageFrame);
+
+// 只发刷新触发, 然后放行暂存期间攒下的帧
+static void EPD_StageCommitWork(struct work_struct *work)
+{
+    struct epd_stage *st = container_of(work, struct epd_stage, commit_work);
+    struct epd_dev *epd = container_of(st, struct epd_dev, stage);
+
+    mutex_lock(&epd->hw_lock);
+    if (st->uploaded)
+        EPD_Trigger(epd, st->buf, &st->up, &st->ev);
+    mutex_unlock(&epd->hw_lock);
+
+    mutex_lock(&epd->lock);
+    st->state = EPD_STAGE_IDLE;
+    st->owner = NULL;
+    epd->fstats.displayed++;
+    mutex_unlock(&epd->lock);
+
+    EPD_PostEvent(epd, &st->ev);
+    mod_delayed_work(epd->wq, &epd->refresh_work, 0);
+}
+
+// 硬中断上下文, 不能碰 SPI, 交给高优先级工作队列
+static enum hrtimer_restart EPD_StageTimer(struct hrtimer *timer)
+{
+    struct epd_stage *st = container_of(timer, struct epd_stage, timer);
+
+    queue_work(system_highpri_wq, &st->commit_work);
+    return HRTIMER_NORESTART;
+}
+
+// deadline_ns 为 0 时立即提交, 否则在 clock 上的这个绝对时刻提交
+int EPD_CommitStage(struct epd_dev *epd, u64 deadline_ns, clockid_t clock)
+{
+    struct epd_stage *st = &epd->stage;
+    int ret = 0;
+
+    if (clock != CLOCK_MONOTONIC && clock != CLOCK_REALTIME)
+        return -EINVAL;
+
+    mutex_lock(&epd->lock);
+    if (st->state != EPD_STAGE_READY && st->state != EPD_STAGE_ARMED) {
+        ret = st->state == EPD_STAGE_IDLE ? -ENOENT : -EBUSY;
+        goto out;
+    }
+    // 已经定时的可以改期
+    if (hrtimer_cancel(&st->timer) == 0 && st->state == EPD_STAGE_ARMED) {
+        // 定时器已经触发, 提交正在进行
+        ret = -EALREADY;
+        goto out;
+    }
+    st->state = EPD_STAGE_ARMED;
+    if (!deadline_ns) {
+        queue_work(system_highpri_wq, &st->commit_work);
+        goto out;
+    }
+    hrtimer_init(&st->timer, clock, HRTIMER_MODE_ABS);
+    st->timer.function = EPD_StageTimer;
+    hrtimer_start(&st->timer, ns_to_ktime(deadline_ns), HRTIMER_MODE_ABS);
+out:
+    mutex_unlock(&epd->lock);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(EPD_CommitStage);
+
+// 放弃暂存帧: RAM 0x24 里上传过的区域恢复成屏幕上的内容 (影子帧), 这些区域
+// 还回画布脏区, 由下一次提交刷出去, 然后放行信箱.
+// owner 为 NULL 时放弃已暂存或定时中的帧; 否则只放弃它暂存、还没提交的帧
+int EPD_AbortStage(struct epd_dev *epd, const void *owner)
+{
+    struct epd_stage *st = &epd->stage;
+    int i, ret = 0;
+
+    mutex_lock(&epd->lock);
+    if (owner && (st->owner != owner || st->state != EPD_STAGE_READY)) {
+        ret = -ENOENT;
+        goto out;
+    }
+    if (st->state != EPD_STAGE_READY && st->state != EPD_STAGE_ARMED) {
+        ret = st->state == EPD_STAGE_IDLE ? -ENOENT : -EBUSY;
+        goto out;
+    }
+    if (hrtimer_cancel(&st->timer) == 0 && st->state == EPD_STAGE_ARMED) {
+        // 定时器已经触发, 提交正在进行
+        ret = -EALREADY;
+        goto out;
+    }
+    // 恢复 RAM 期间刷新线程仍然不取信箱
+    st->state = EPD_STAGE_UPLOADING;
+    mutex_unlock(&epd->lock);
+
+    mutex_lock(&epd->hw_lock);
+    for (i = 0; i < st->up.n; i++)
+        EPD_WriteRam(epd, 0x24, epd->shadow_buf, &st->up.rects[i]);
+    EPD_SendBarrier(epd);
+    mutex_unlock(&epd->hw_lock);
+
+    mutex_lock(&epd->lock);
+    for (i = 0; i < st->up.n; i++)
+        EPD_DamageRect(&epd->damage, &st->up.rects[i]);
+    st->state = EPD_STAGE_IDLE;
+    st->owner = NULL;
+    mutex_unlock(&epd->lock);
+
+    st->ev.flags |= EPD_EVENT_ABORTED;
+    st->ev.refresh_ns = ktime_get_ns();
+    EPD_PostEvent(epd, &st->ev);
+    mod_delayed_work(epd->wq, &epd->refresh_work, 0);
+    return 0;
+out:
+    mutex_unlock(&epd->lock);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(EPD_AbortStage);
+
+static void EPD_FreeFrames(struct epd_dev *epd)
+{
+    int i;
+
+    kfree(epd->stage.buf);
+    for (i = 0; i < EPD_MAILBOX_FRAMES; i++)
+        kfree(epd->frames[i].buf);
+}
+
+static int EPD_InitFrames(struct epd_dev *epd)
+{
+    int i;
+
+    INIT_LIST_HEAD(&epd->free_frames);
+    epd->pending = NULL;
+    INIT_DELAYED_WORK(&epd->refresh_work, EPD_RefreshWork);
+    spin_lock_init(&epd->event_lock);
+    init_waitqueue_head(&epd->event_wait);
+    INIT_LIST_HEAD(&epd->frame_waiters);
+    epd->stage.state = EPD_STAGE_IDLE;
+    INIT_WORK(&epd->stage.commit_work, EPD_StageCommitWork);
+    hrtimer_init(&epd->stage.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    epd->stage.timer.function = EPD_StageTimer;
+
+    for (i = 0; i < EPD_MAILBOX_FRAMES; i++) {
+        epd->frames[i].buf = kmalloc(WIDTH * HEIGHT, GFP_KERNEL);
+        if (!epd->frames[i].buf) {
+            EPD_FreeFrames(epd);
+            return -ENOMEM;
+        }
+        list_add_tail(&epd->frames[i].node, &epd->free_frames);
+    }
+    epd->stage.buf = kmalloc(WIDTH * HEIGHT, GFP_KERNEL);
+    if (!epd->stage.buf) {
+        EPD_FreeFrames(epd);
+        return -ENOMEM;
+    }
+
+    epd->wq = alloc_ordered_workqueue("epd_refresh", 0);
+    if (!epd->wq) {
+        EPD_FreeFrames(epd);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+// display_buf 按单页拆开分配, 每页各自计数, 可以逐页插进用户映射.
+// 这里只放掉驱动自己的引用, 还被 mmap 着的页等最后一个映射拆掉才真正释放
+static int EPD_AllocDisplayBuf(struct epd_dev *epd)
+{
+    unsigned int order = get_order(EPD_FB_SIZE);
+    struct page *page;
+
+    page = alloc_pages(GFP_KERNEL | __GFP_ZERO, order);
+    if (!page)
+        return -ENOMEM;
+    split_page(page, order);
+    epd->display_buf = page_address(page);
+    return 0;
+}
+
+static void EPD_FreeDisplayBuf(struct epd_dev *epd)
+{
+    unsigned long off;
+
+    if (!epd->display_buf)
+        return;
+    for (off = 0; off < PAGE_SIZE << get_order(EPD_FB_SIZE); off += PAGE_SIZE)
+        put_page(virt_to_page(epd->display_buf + off));
+    epd->display_buf = NULL;
+}
+
 static int EPD_Init(struct epd_dev *epd)
 {
     pr_info("Init epd device");
 
+    mutex_init(&epd->lock);
+    mutex_init(&epd->hw_lock);
+    INIT_DELAYED_WORK(&epd->cleanup_work, EPD_CleanupWork);
+    epd->policy = (struct epd_policy){
+        .max_partials = 10,
+        .full_diff_pct = 50,
+        .ghost_budget = 8000,
+        .cleanup_partials = 3,
+        .idle_ms = 5000,
+        .refresh_interval_ms = 0,
+        .refresh_burst = 3,
+    };
+    epd->tokens = epd->policy.refresh_burst;
+    epd->token_ns = ktime_get_ns();
+    // 字符设备/fbdev/DRM 默认都由策略逐帧选择局刷或全刷
+    epd->refresh_mode = EPD_REFRESH_AUTO;
+
     // create display buffer
-    epd->display_buf = kmalloc(WIDTH * HEIGHT, GFP_KERNEL);
-    if (!epd->display_buf) {
+    if (EPD_AllocDisplayBuf(epd))
+        return -ENOMEM;
+
+    epd->shadow_buf = kmalloc(WIDTH * HEIGHT, GFP_KERNEL);
+    epd->xfer_buf = kmalloc(WIDTH * HEIGHT, GFP_KERNEL);
+    epd->stage_buf = kmalloc(EPD_STAGE_SIZE, GFP_KERNEL);
+    if (!epd->shadow_buf || !epd->xfer_buf || !epd->stage_buf) {
+        kfree(epd->stage_buf);
+        kfree(epd->xfer_buf);
+        kfree(epd->shadow_buf);
+        EPD_FreeDisplayBuf(epd);
+        return -ENOMEM;
+    }
+    epd->stage_len = 0;
+    epd->dc = -1;
+
+    if (EPD_InitFrames(epd)) {
+        kfree(epd->stage_buf);
+        kfree(epd->xfer_buf);
+        kfree(epd->shadow_buf);
+        EPD_FreeDisplayBuf(epd);
         return -ENOMEM;
     }
-    memset(epd->display_buf, 0, WIDTH * HEIGHT);
 
     EPD_init_full(epd);
     EPD_Clear(epd);
+    // 屏幕是白的, display_buf 还没提交过
+    EPD_Damage(epd, &epd_full_rect);
     return 0;
 }
 
-static void EPD_Flush(struct epd_dev *epd)
+// 取 GPIO, 配置 SPI, 初始化面板和刷新线程. 字符设备和 DRM 驱动共用
+int EPD_Setup(struct epd_dev *epd, struct spi_device *spi)
 {
-    EPD_SendCmd(epd, 0x24);  // WRITE_RAM
-    for(int i = 0; i < WIDTH * HEIGHT; i++) {
-        EPD_SendData(epd, epd->display_buf[i]);
+    struct device *dev = &spi->dev;
+    int ret;
+
+    epd->spi = spi;
+
+    epd->gdc = devm_gpiod_get(dev, "dc", GPIOD_OUT_LOW);
+    epd->grst = devm_gpiod_get(dev, "reset", GPIOD_OUT_HIGH);
+    epd->gbusy = devm_gpiod_get(dev, "busy", GPIOD_IN);
+    epd->gpwr = devm_gpiod_get(dev, "pwr", GPIOD_OUT_HIGH);
+
+    if (IS_ERR(epd->gdc) || IS_ERR(epd->grst) || 
+        IS_ERR(epd->gbusy) || IS_ERR(epd->gpwr)) {
+        dev_err(dev, "failed to get gpios\n");
+        return -ENODEV;
     }
+    EPD_SetupBusyIrq(epd, dev);
+
+    // init EPD
+    epd->spi->mode = SPI_MODE_0;
+    epd->spi->bits_per_word = 8;
+    epd->spi->max_speed_hz = 1000000;
+    spi_setup(epd->spi);
+    
+    ret = EPD_Init(epd);
+    if(ret < 0) {
+	pr_err("Failed to allocate display buffer\n");
+        return -ENOMEM;
+    }
+    return 0;
 }
+EXPORT_SYMBOL_GPL(EPD_Setup);
+
+void EPD_Release(struct epd_dev *epd)
+{
+    // 还没到点的暂存帧立即提交
+    hrtimer_cancel(&epd->stage.timer);
+    if (READ_ONCE(epd->stage.state) != EPD_STAGE_IDLE)
+        queue_work(system_highpri_wq, &epd->stage.commit_work);
+    flush_work(&epd->stage.commit_work);
+    // 先刷完已排队的帧 (不再限速), 再停掉清理定时
+    WRITE_ONCE(epd->policy.refresh_interval_ms, 0);
+    flush_delayed_work(&epd->refresh_work);
+    flush_workqueue(epd->wq);
+    cancel_delayed_work_sync(&epd->cleanup_work);
+    destroy_workqueue(epd->wq);
+    EPD_Clear(epd);
+    EPD_FreeFrames(epd);
+    EPD_FreeDisplayBuf(epd);
+    kfree(epd->shadow_buf);
+    kfree(epd->xfer_buf);
+    kfree(epd->stage_buf);
+}
+EXPORT_SYMBOL_GPL(EPD_Release);
 
 #define LANDSCAPE
-static void EPD_DrawChar(struct epd_dev *epd, uint16_t x, uint16_t y, char ch) {
-    uint8_t width = Font12.Width;
-    uint8_t height = Font12.Height;
-    const uint8_t *ptr = &Font12.table[(ch - ' ') * height];
-
-    for(uint8_t j = 0; j < height; j++) {
-        uint8_t line = ptr[j];
-        for(uint8_t i = 0; i < width; i++) {
-            if(line & 0x80) {
+/*------------------------- 字形图集 -------------------------*/
+#define EPD_FONT_FIRST      ' '
+#define EPD_FONT_CHARS      ('~' - ' ' + 1)
+#define EPD_FONT_ATLAS_SIZE 8192    // 95 x 16 + 95 x 64, 按 64 字节对齐后的总和
+#define EPD_FONT_GLYPH_MAX  64
+
+// 图集里的字体都由内置字库按整数倍放大得到
+static const struct {
+    const sFONT *src;
+    uint8_t scale;
+} epd_font_src[EPD_FONT_COUNT] = {
+    [EPD_FONT_12] = { &Font12, 1 },
+    [EPD_FONT_24] = { &Font12, 2 },
+};
+
+static uint8_t epd_font_atlas[EPD_FONT_ATLAS_SIZE] __aligned(64);
+static struct epd_font epd_fonts[EPD_FONT_COUNT];
+static DEFINE_MUTEX(epd_font_lock);
+static bool epd_font_ready;
+
+static inline const uint8_t *EPD_FontGlyph(const struct epd_font *f, char ch)
+{
+    if (ch < f->first || ch >= f->first + f->count)
+        ch = '?';
+    return epd_font_atlas + f->offset + (ch - f->first) * f->glyph_bytes;
+}
+
+// 把一种字库转成面板的字节布局: 横屏时字的第 j 行落在面板的第 EPD_2IN13_V2_WIDTH - y - j 列,
+// 第 i 列落在面板的第 x + i 行, 转好后每个字只需按行整字节贴上去
+static void EPD_FontBuild(struct epd_font *f, const sFONT *font, unsigned int scale)
+{
+    unsigned int src_stride = DIV_ROUND_UP(font->Width, 8);
+    unsigned int w = font->Width * scale, h = font->Height * scale;
+    const uint8_t *src;
+    uint8_t *dst;
+    unsigned int c, i, j, si, sj;
+
+    f->cell_w = w;
+    f->cell_h = h;
 #ifndef LANDSCAPE
-                uint16_t real_x = x + i;
-                uint16_t real_y = y + j;
+    f->width = w;
+    f->height = h;
 #else
-                uint16_t real_x = EPD_2IN13_V2_WIDTH - y - j;
-                uint16_t real_y = x + i;
+    f->width = h;
+    f->height = w;
+#endif
+    f->stride = DIV_ROUND_UP(f->width, 8);
+    f->glyph_bytes = roundup_pow_of_two(f->stride * f->height);
+    f->first = EPD_FONT_FIRST;
+    f->count = EPD_FONT_CHARS;
+
+    for (c = 0; c < f->count; c++) {
+        src = &font->table[c * font->Height * src_stride];
+        dst = epd_font_atlas + f->offset + c * f->glyph_bytes;
+        for (j = 0; j < h; j++) {
+            for (i = 0; i < w; i++) {
+                si = i / scale;
+                sj = j / scale;
+                if (!(src[sj * src_stride + si / 8] & (0x80 >> (si % 8))))
+                    continue;
+#ifndef LANDSCAPE
+                dst[j * f->stride + i / 8] |= 0x80 >> (i % 8);
+#else
+                // 第 0 行在最右边
+                dst[i * f->stride + (h - 1 - j) / 8] |= 0x80 >> ((h - 1 - j) % 8);
 #endif
-                if(real_x < EPD_2IN13_V2_WIDTH && real_y < EPD_2IN13_V2_HEIGHT) {
-                    uint16_t byte_pos = real_y * WIDTH + real_x / 8;
-                    uint8_t bit_pos = 7 - (real_x % 8);
-                    epd->display_buf[byte_pos] |= (1 << bit_pos);
-                }
             }
-            line <<= 1;
         }
     }
 }
 
+// 所有设备共用一份图集, 第一次用到文字时生成
+static void EPD_FontInit(void)
+{
+    const sFONT *src;
+    unsigned int id, offset = 0, w, h, bytes;
+
+    mutex_lock(&epd_font_lock);
+    if (epd_font_ready)
+        goto out;
+    for (id = 0; id < EPD_FONT_COUNT; id++) {
+        src = epd_font_src[id].src;
+        w = src->Width * epd_font_src[id].scale;
+        h = src->Height * epd_font_src[id].scale;
+#ifndef LANDSCAPE
+        bytes = roundup_pow_of_two(DIV_ROUND_UP(w, 8) * h);
+#else
+        bytes = roundup_pow_of_two(DIV_ROUND_UP(h, 8) * w);
+#endif
+        // 每种字体从缓存行边界开始; 放不下的字体退回第一种
+        offset = ALIGN(offset, 64);
+        if (WARN_ON(bytes > EPD_FONT_GLYPH_MAX ||
+                    offset + bytes * EPD_FONT_CHARS > EPD_FONT_ATLAS_SIZE)) {
+            epd_fonts[id] = epd_fonts[0];
+            continue;
+        }
+        epd_fonts[id].offset = offset;
+        EPD_FontBuild(&epd_fonts[id], src, epd_font_src[id].scale);
+        offset += epd_fonts[id].glyph_bytes * epd_fonts[id].count;
+    }
+    epd_font_ready = true;
+out:
+    mutex_unlock(&epd_font_lock);
+}
+
+// 把字符贴到格子 (x, y), 背景一起写掉, 不碰相邻的格子. 超出屏幕的部分裁掉
+static void EPD_DrawChar(struct epd_dev *epd, uint16_t x, uint16_t y, char ch,
+                         bool inverse) {
+    const struct epd_font *f = epd->text.font;
+    uint8_t inv[EPD_FONT_GLYPH_MAX];
+    const uint8_t *glyph = EPD_FontGlyph(f, ch);
+    struct epd_rect r;
+    unsigned int i;
+
+    if (inverse) {
+        for (i = 0; i < f->glyph_bytes; i++)
+            inv[i] = ~glyph[i];
+        glyph = inv;
+    }
+
+#ifndef LANDSCAPE
+    if (EPD_BlitBits(epd->display_buf, x, y, f->width, f->height,
+                     glyph, f->stride, &r))
+#else
+    if (EPD_BlitBits(epd->display_buf, EPD_2IN13_V2_WIDTH - y - (f->width - 1), x,
+                     f->width, f->height, glyph, f->stride, &r))
+#endif
+        EPD_Damage(epd, &r);
+}
+
 #ifndef LANDSCAPE        
 #define BUF_WIDTH EPD_2IN13_V2_WIDTH
 #define BUF_HEIGHT EPD_2IN13_V2_HEIGHT
@@ -234,33 +1423,192 @@ static void EPD_DrawChar(struct epd_dev *epd, uint16_t x, uint16_t y, char ch) {
 #define BUF_HEIGHT EPD_2IN13_V2_WIDTH
 #endif	
 
-static void EPD_print(struct epd_dev *epd, char *text_buf, size_t count) {
-    EPD_Clear(epd);
+/*------------------------- 文字网格 -------------------------*/
+static const struct epd_cell epd_blank_cell = { ' ', 0 };
 
-    int i;
-    uint16_t x = 0, y = 0;
-    
-    // 渲染文本
-    for(i = 0; i < count; i++) {
-        if(text_buf[i] == '\n') {
-            x = 0;
-            y += Font12.Height;
-            continue;
+static void EPD_TextInit(struct epd_text *t, unsigned int font)
+{
+    int r, c;
+
+    EPD_FontInit();
+    t->font = &epd_fonts[font];
+    t->cols = min(BUF_WIDTH / t->font->cell_w, EPD_TEXT_MAX_COLS);
+    t->rows = min(BUF_HEIGHT / t->font->cell_h, EPD_TEXT_MAX_ROWS);
+    for (r = 0; r < EPD_TEXT_MAX_ROWS; r++) {
+        for (c = 0; c < EPD_TEXT_MAX_COLS; c++) {
+            t->cells[r][c] = epd_blank_cell;
+            t->shown[r][c] = epd_blank_cell;
         }
+    }
+    t->cur_x = t->cur_y = t->top = 0;
+    t->attr = 0;
+    t->esc = 0;
+}
+
+static struct epd_cell *EPD_TextRow(struct epd_text *t, uint16_t y)
+{
+    return t->cells[(t->top + y) % t->rows];
+}
 
-        if(x + Font12.Width > BUF_WIDTH) {
-            x = 0;
-            y += Font12.Height;
+static void EPD_TextClearRow(struct epd_text *t, uint16_t y, uint16_t from)
+{
+    struct epd_cell *row = EPD_TextRow(t, y);
+    uint16_t c;
+
+    for (c = from; c < t->cols; c++)
+        row[c] = epd_blank_cell;
+}
+
+static void EPD_TextNewline(struct epd_text *t)
+{
+    t->cur_x = 0;
+    if (t->cur_y + 1 < t->rows) {
+        t->cur_y++;
+        return;
+    }
+    // 滚屏只移动环形起点, 新的底行清空
+    t->top = (t->top + 1) % t->rows;
+    EPD_TextClearRow(t, t->rows - 1, 0);
+}
+
+static void EPD_TextClear(struct epd_text *t)
+{
+    uint16_t y;
+
+    for (y = 0; y < t->rows; y++)
+        EPD_TextClearRow(t, y, 0);
+    t->cur_x = t->cur_y = 0;
+}
+
+// ESC [ 序列: 只认 m (0/27 关反显, 7 开反显), J (清屏), H (回到左上), K (清到行尾)
+static void EPD_TextEscape(struct epd_text *t, char ch)
+{
+    if (t->esc == 1) {
+        t->esc = ch == '[' ? 2 : 0;
+        t->esc_arg = 0;
+        return;
+    }
+    if (ch >= '0' && ch <= '9') {
+        t->esc_arg = min(t->esc_arg * 10 + (ch - '0'), 99);
+        return;
+    }
+    t->esc = 0;
+    switch (ch) {
+    case 'm':
+        if (t->esc_arg == 7)
+            t->attr |= EPD_ATTR_INVERSE;
+        else if (t->esc_arg == 0 || t->esc_arg == 27)
+            t->attr &= ~EPD_ATTR_INVERSE;
+        break;
+    case 'J':
+        EPD_TextClear(t);
+        break;
+    case 'H':
+        t->cur_x = t->cur_y = 0;
+        break;
+    case 'K':
+        EPD_TextClearRow(t, t->cur_y, min(t->cur_x, t->cols));
+        break;
+    default:
+        break;
+    }
+}
+
+// 把文本追加进网格, 只改网格不画. 调用者持有 lock
+static void EPD_TextWrite(struct epd_dev *epd, const char *buf, size_t count)
+{
+    struct epd_text *t = &epd->text;
+    size_t i;
+    char ch;
+
+    if (!t->cols)
+        EPD_TextInit(t, EPD_FONT_12);
+
+    for (i = 0; i < count; i++) {
+        ch = buf[i];
+        if (t->esc) {
+            EPD_TextEscape(t, ch);
+            continue;
         }
-        
-        if(y + Font12.Height > BUF_HEIGHT) {
-	    pr_info("epd chars out of bound %d - portrait", EPD_2IN13_V2_WIDTH);
-            break;  // 超出显示范围
+        switch (ch) {
+        case '\n':
+            EPD_TextNewline(t);
+            break;
+        case '\r':
+            t->cur_x = 0;
+            break;
+        case '\b':
+            if (t->cur_x)
+                t->cur_x = min(t->cur_x, t->cols) - 1;
+            break;
+        case '\t':
+            t->cur_x = min_t(uint16_t, (t->cur_x + 8) & ~7, t->cols);
+            break;
+        case '\f':
+            EPD_TextClear(t);
+            break;
+        case '\033':
+            t->esc = 1;
+            break;
+        default:
+            if (ch < ' ' || ch > '~')
+                break;
+            if (t->cur_x >= t->cols)
+                EPD_TextNewline(t);
+            EPD_TextRow(t, t->cur_y)[t->cur_x++] = (struct epd_cell){ ch, t->attr };
+            break;
         }
-        EPD_DrawChar(epd, x, y, text_buf[i]);
-        x += Font12.Width;
     }
-    
-    EPD_Flush(epd);
-    EPD_RefreshDisplay(epd);
 }
+
+// 只重画与屏幕上不同的格子, 画过的格子记为脏区. 调用者持有 lock
+static void EPD_TextRender(struct epd_dev *epd)
+{
+    struct epd_text *t = &epd->text;
+    const struct epd_cell *row;
+    struct epd_cell *shown;
+    uint16_t x, y;
+    bool inverse;
+
+    for (y = 0; y < t->rows; y++) {
+        row = EPD_TextRow(t, y);
+        shown = t->shown[y];
+        for (x = 0; x < t->cols; x++) {
+            if (row[x].ch == shown[x].ch && row[x].attr == shown[x].attr)
+                continue;
+            inverse = row[x].attr & EPD_ATTR_INVERSE;
+            EPD_DrawChar(epd, x * t->font->cell_w, y * t->font->cell_h, row[x].ch, inverse);
+            shown[x] = row[x];
+        }
+    }
+}
+
+// 换字体时先把旧网格擦掉, 再按新字体的格子大小重排.
+// 画布有变化 (擦掉了旧文字) 时返回 true. 调用者持有 lock
+bool EPD_TextSetFont(struct epd_dev *epd, unsigned int font)
+{
+    struct epd_text *t = &epd->text;
+    bool cleared = false;
+
+    if (t->cols && t->font == &epd_fonts[font])
+        return false;
+    if (t->cols) {
+        EPD_TextClear(t);
+        EPD_TextRender(epd);
+        cleared = true;
+    }
+    EPD_TextInit(t, font);
+    return cleared;
+}
+EXPORT_SYMBOL_GPL(EPD_TextSetFont);
+
+// 把文本追加进网格并画出变化的格子, 上传和刷新交给刷新线程. 调用者持有 lock
+void EPD_print(struct epd_dev *epd, const char *text_buf, size_t count) {
+    EPD_TextWrite(epd, text_buf, count);
+    EPD_TextRender(epd);
+}
+EXPORT_SYMBOL_GPL(EPD_print);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("ck");
+MODULE_DESCRIPTION("Waveshare 2.13inch V2 EPD panel core");
@@ -0,0 +1,267 @@
+/**
+* EPD 驱动核心: 面板硬件、画布、帧信箱和文字网格.
+* char device (含 fbdev) 和 DRM 两个前端共用, 核心单独编译成 epd_2in13v2.ko
+**/
+#ifndef _EPD_2IN13V2_H
+#define _EPD_2IN13V2_H
+
+#include <linux/completion.h>
+#include <linux/gpio/consumer.h>
+#include <linux/hrtimer.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/spi/spi.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "epd_uapi.h"
+
+#define EPD_2IN13_V2_WIDTH      122 
+#define EPD_2IN13_V2_HEIGHT     250 
+
+#define WIDTH ((EPD_2IN13_V2_WIDTH % 8 == 0)? (EPD_2IN13_V2_WIDTH / 8 ): (EPD_2IN13_V2_WIDTH / 8 + 1))
+#define HEIGHT (EPD_2IN13_V2_HEIGHT) 
+
+#define EPD_FB_SIZE      PAGE_ALIGN(WIDTH * HEIGHT)  // display_buf 按整页分配, 可 mmap
+
+// SPI 事务计数, saved = cmds + data_bytes - transfers
+struct epd_xfer_stats {
+    uint32_t cmds;
+    uint32_t data_bytes;
+    uint32_t transfers;
+};
+
+enum epd_refresh {
+    EPD_REFRESH_FULL,       // 0xC7, 全刷 LUT
+    EPD_REFRESH_PARTIAL,    // 0x0C, 局刷 LUT
+    EPD_REFRESH_AUTO,       // 由刷新策略逐帧决定
+    EPD_REFRESH_CLEAR,      // 先整屏刷白再全刷, 只在用户明确要求时
+};
+
+// 刷新策略, 可通过 sysfs 调整. 各项用 READ_ONCE/WRITE_ONCE 单独读写, 不加锁
+#define EPD_GHOST_BANDS 8   // 按行把屏幕分成若干条带统计像素翻转
+struct epd_policy {
+    unsigned int max_partials;      // 连续局刷达到此数强制全刷
+    unsigned int full_diff_pct;     // 变化字节占整屏比例 (%) 超过此值直接全刷
+    unsigned int ghost_budget;      // 单条带自上次全刷以来允许的像素翻转数
+    unsigned int cleanup_partials;  // 局刷攒到此数后, 空闲时做一次清理全刷
+    unsigned int idle_ms;           // 多久没有更新算空闲, 0 关闭清理
+    unsigned int refresh_interval_ms;   // 令牌桶: 每隔多久攒一次刷新, 0 不限速
+    unsigned int refresh_burst;         // 最多攒几次
+};
+
+struct epd_refresh_stats {
+    uint32_t full;
+    uint32_t partial;
+    uint32_t cleanups;
+    uint32_t partials_since_full;
+    uint32_t band_flips[EPD_GHOST_BANDS];  // 自上次全刷以来
+};
+
+// 显存中的矩形: x 以字节列计 [x0, x1), y 以行计 [y0, y1)
+struct epd_rect {
+    uint16_t x0, y0;
+    uint16_t x1, y1;
+};
+
+// 脏区列表, 相接的矩形合并, 满了就并入面积增长最小的那个
+#define EPD_MAX_DAMAGE 4
+struct epd_damage {
+    struct epd_rect rect[EPD_MAX_DAMAGE];
+    int count;
+};
+
+// 提交给刷新线程的一帧: display_buf 的快照加上它的脏区.
+// 两帧轮换: 一帧在刷, 一帧待刷, 新提交直接覆盖待刷帧
+#define EPD_MAILBOX_FRAMES 2
+struct epd_frame {
+    struct list_head node;
+    uint8_t *buf;
+    struct epd_damage damage;
+    enum epd_refresh mode;
+    bool clear;                 // 上传前先整屏刷白 (EPD_REFRESH_CLEAR)
+    uint32_t seq;               // 最新一次提交的序号
+    u64 queued_ns;
+    unsigned int prio;          // 合并进来的提交中最高的优先级
+    u64 class_queued_ns[EPD_PRIO_COUNT];    // 各优先级最早一次提交, 0 表示没有
+};
+
+// 一次提交里变化的字节数和各条带的像素翻转数
+struct epd_diff {
+    uint32_t bytes;
+    uint32_t flips[EPD_GHOST_BANDS];
+};
+
+// 已写进 RAM 0x24, 还没触发刷新的一帧
+struct epd_upload {
+    struct epd_rect rects[EPD_MAX_DAMAGE];
+    int n;
+    struct epd_diff diff;
+    enum epd_refresh mode;
+};
+
+// 两段式提交: 先把一帧写进 RAM 0x24, 到期 (hrtimer) 时只发刷新触发.
+// 暂存期间刷新线程不取信箱, 免得把暂存的内容提前刷出去
+enum epd_stage_state {
+    EPD_STAGE_IDLE,
+    EPD_STAGE_UPLOADING,
+    EPD_STAGE_READY,            // 已在 RAM 里, 等提交
+    EPD_STAGE_ARMED,            // 定时器已启动
+};
+
+struct epd_stage {
+    enum epd_stage_state state; // 由 lock 保护
+    const void *owner;          // 暂存者, 还没提交就离开时据此放弃. 由 lock 保护
+    bool uploaded;              // false: 与屏幕相同, 提交时不刷新
+    uint8_t *buf;               // 暂存帧, 刷新后要同步进 0x26 和影子帧
+    struct epd_upload up;
+    struct epd_event ev;
+    struct hrtimer timer;
+    struct work_struct commit_work;
+};
+
+// 刷新完成事件环, 每个打开的文件各自记读到哪一条
+#define EPD_EVENT_RING 16
+
+struct epd_frame_stats {
+    uint32_t submitted;
+    uint32_t coalesced;         // 还没刷就被新提交覆盖的帧
+    uint32_t displayed;
+};
+
+// 各优先级从提交到上屏的延迟
+struct epd_qos_stats {
+    uint32_t submitted;
+    uint32_t displayed;
+    u64 latency_total_ns;
+    u64 latency_max_ns;
+};
+
+// 文字网格: 按格记录字符和属性, 写入像终端一样追加, 只重画内容变了的格子
+#define EPD_TEXT_MAX_COLS   64
+#define EPD_TEXT_MAX_ROWS   16
+#define EPD_ATTR_INVERSE    0x1
+
+// 字形图集里一种字体的描述. 所有字体的字形连续放在一块按缓存行对齐的内存里,
+// 每个字形占 2 的幂个字节, 不超过 64 字节的字形不会跨缓存行
+struct epd_font {
+    uint32_t offset;            // 第一个字形在图集中的位置
+    uint16_t glyph_bytes;       // 每个字形占的字节数
+    uint16_t stride;            // 字形每行字节数, 高位在左
+    uint16_t width, height;     // 字形在面板上占的像素宽高
+    uint16_t cell_w, cell_h;    // 文字网格一格的宽高 (横屏时与面板方向相反)
+    uint8_t first, count;       // 覆盖的字符范围
+};
+
+struct epd_cell {
+    char ch;
+    uint8_t attr;
+};
+
+struct epd_text {
+    // cells 按行环形存放, 第 top 行显示在最上面; shown 按屏幕位置记录已画出的内容
+    struct epd_cell cells[EPD_TEXT_MAX_ROWS][EPD_TEXT_MAX_COLS];
+    struct epd_cell shown[EPD_TEXT_MAX_ROWS][EPD_TEXT_MAX_COLS];
+    uint16_t cols, rows;        // 0 表示还没初始化
+    uint16_t cur_x, cur_y;      // 光标, cur_y 为屏幕行; cur_x == cols 表示下一个字符换行
+    uint16_t top;
+    uint8_t attr;               // 新写入字符的属性
+    uint8_t esc;                // ESC 序列解析状态
+    uint8_t esc_arg;
+    const struct epd_font *font;
+};
+
+struct epd_dev {
+    struct spi_device *spi;
+    struct gpio_desc *gdc;
+    struct gpio_desc *grst;
+    struct gpio_desc *gbusy;
+    struct gpio_desc *gpwr;
+    int busy_irq;               // falling edge on BUSY, 0 = poll
+    struct completion busy_done;
+    uint8_t * display_buf;  // 整页分配, 用户态可 mmap 直接绘制
+    uint8_t * shadow_buf;   // 上一次提交到屏幕上的帧, 与 RAM 0x24/0x26 一致
+    uint8_t * xfer_buf;     // DMA-safe staging for bulk RAM writes
+    uint8_t * stage_buf;    // coalesced parameter bytes, flushed on barrier
+    size_t stage_len;
+    int dc;                 // last level driven on gdc, -1 = unknown
+    struct epd_xfer_stats stats;
+    enum epd_refresh refresh_mode;  // 用户选择的刷新方式
+    enum epd_refresh lut_mode;      // 当前写入控制器的 LUT
+    struct epd_damage damage;       // display_buf 中尚未上传的区域
+    struct epd_text text;           // write() 文本模式的字符网格
+    struct mutex lock;              // 保护 display_buf, 脏区和帧信箱
+    struct mutex hw_lock;           // 保护面板硬件, 影子帧和下面的策略状态
+    struct epd_policy policy;
+    struct epd_refresh_stats rstats;
+    struct delayed_work cleanup_work;
+
+    // 写者把画布拍成一帧放进信箱, 有序工作队列负责上传和刷新
+    struct workqueue_struct *wq;
+    struct delayed_work refresh_work;   // 令牌不够时推迟
+    struct epd_frame *pending;      // 信箱里最新的待刷帧
+    struct list_head free_frames;
+    struct epd_frame frames[EPD_MAILBOX_FRAMES];
+    struct epd_frame_stats fstats;
+    struct epd_stage stage;
+
+    // 刷新限速和各优先级统计, 由 lock 保护
+    unsigned int tokens;
+    u64 token_ns;                   // 上一次补充令牌的时刻
+    uint32_t throttled;             // 因为没有令牌推迟的次数
+    struct epd_qos_stats qstats[EPD_PRIO_COUNT];
+
+    // 图层, 第一次用到时才分配. 由 lock 保护
+    uint8_t *layer_buf;
+    struct epd_damage layer_damage; // 改过、还没合成进画布的区域
+
+    // 完成事件, poll/read/fasync 用
+    spinlock_t event_lock;
+    struct epd_event events[EPD_EVENT_RING];
+    uint32_t event_count;           // 产生过的事件总数
+    wait_queue_head_t event_wait;   // 有新事件或信箱被取空
+    struct fasync_struct *fasync;
+    // 等某一帧刷完的异步请求 (io_uring), 由 event_lock 保护
+    struct list_head frame_waiters;
+    void (*frame_done)(struct epd_dev *epd, const struct epd_event *ev);
+};
+
+
+extern const struct epd_rect epd_full_rect;
+// 常量源图, 配合 stride 0 用来填充或清除一块区域
+extern const uint8_t epd_row_ones[WIDTH];
+extern const uint8_t epd_row_zeros[WIDTH];
+
+/* 脏区和贴图 */
+void EPD_DamageRect(struct epd_damage *d, const struct epd_rect *r);
+void EPD_Damage(struct epd_dev *epd, const struct epd_rect *r);
+bool EPD_PixelRect(int px0, int py0, int px1, int py1, struct epd_rect *r);
+bool EPD_ByteRect(unsigned long off, size_t len, struct epd_rect *r);
+bool EPD_BlitBits(uint8_t *buf, unsigned int x, unsigned int y,
+                  unsigned int w, unsigned int h,
+                  const uint8_t *src, unsigned int stride,
+                  struct epd_rect *r);
+void EPD_Blit(struct epd_dev *epd, unsigned int x, unsigned int y,
+              unsigned int w, unsigned int h,
+              const uint8_t *src, unsigned int stride);
+
+/* 帧信箱, 暂存提交和完成事件 */
+uint32_t EPD_SubmitFrame(struct epd_dev *epd, enum epd_refresh mode,
+                         unsigned int prio);
+int EPD_StageFrame(struct epd_dev *epd, enum epd_refresh mode, const void *owner);
+int EPD_CommitStage(struct epd_dev *epd, u64 deadline_ns, clockid_t clock);
+int EPD_AbortStage(struct epd_dev *epd, const void *owner);
+bool EPD_ReadEvent(struct epd_dev *epd, uint32_t *next, struct epd_event *ev);
+bool EPD_EventPending(struct epd_dev *epd, uint32_t next);
+
+/* 文字网格 */
+bool EPD_TextSetFont(struct epd_dev *epd, unsigned int font);
+void EPD_print(struct epd_dev *epd, const char *text_buf, size_t count);
+
+/* 设备 */
+int EPD_Setup(struct epd_dev *epd, struct spi_device *spi);
+void EPD_Release(struct epd_dev *epd);
+
+#endif
@@ -0,0 +1,46 @@
+/**
+* char device 前端: /dev/epd0 加上同一模块里的 fbdev 和图层
+**/
+#ifndef _EPD_CHAR_DEVICE_H
+#define _EPD_CHAR_DEVICE_H
+
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/rwsem.h>
+
+#include "epd_2in13v2.h"
+
+struct fb_info;
+
+// char device 前端的每设备状态. 内存跟着 dev 的引用走: 打开的文件经 cdev
+// 持有引用, 设备移除后要等最后一个文件关闭才释放
+struct epd_char {
+    struct epd_dev epd;
+    struct device dev;
+    struct cdev cdev;
+    struct rw_semaphore remove_sem; // 文件操作持读锁, 移除时持写锁置 dead
+    bool dead;                      // 核心已拆除, 文件操作一律 -ENODEV
+
+    // fbdev 接口, 缺页跟踪写过的页, 每个延时周期提交一帧
+    struct fb_info *fb;
+};
+
+static inline struct epd_char *EPD_Char(struct epd_dev *epd)
+{
+    return container_of(epd, struct epd_char, epd);
+}
+
+/* epd_fb.c */
+int EPD_FbRegister(struct epd_char *ec, struct device *dev);
+void EPD_FbUnregister(struct epd_char *ec);
+
+/* epd_layer.c */
+void EPD_LayerFree(struct epd_dev *epd);
+void EPD_LayerCompose(struct epd_dev *epd);
+int EPD_LayerUpdate(struct epd_dev *epd, unsigned int l,
+                    unsigned int x, unsigned int y,
+                    unsigned int w, unsigned int h,
+                    const uint8_t *bits, const uint8_t *mask,
+                    unsigned int stride);
+
+#endif
@@ -0,0 +1,1041 @@
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/delay.h>
+#include <linux/of.h>
+#include <linux/of_device.h>
+#include <linux/spi/spi.h>
+#include <linux/gpio/consumer.h>
+#include <linux/interrupt.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <linux/io_uring.h>
+
+#include "epd_char_device.h"
+
+#define MAX_CHAR_COUNT 256
+
+/* Char device */
+// 每个打开的文件各自的状态
+struct epd_file {
+    struct epd_dev *epd;
+    uint32_t ev_next;       // 下一条要读的完成事件
+    uint32_t mode;          // EPD_MODE_TEXT / EPD_MODE_FRAME
+    uint32_t prio;          // EPD_PRIO_*, 本文件提交的帧的优先级
+};
+
+// 进入会碰核心的文件操作. 设备已移除时返回 false, 否则持有 remove_sem 读锁
+static bool EPD_CharEnter(struct epd_dev *epd)
+{
+    struct epd_char *ec = EPD_Char(epd);
+
+    down_read(&ec->remove_sem);
+    if (ec->dead) {
+        up_read(&ec->remove_sem);
+        return false;
+    }
+    return true;
+}
+
+static void EPD_CharExit(struct epd_dev *epd)
+{
+    up_read(&EPD_Char(epd)->remove_sem);
+}
+
+static int epd_open(struct inode *inode, struct file *filp) {
+    pr_info("opening epd device\n");
+    struct epd_char *ec = container_of(inode->i_cdev, struct epd_char, cdev);
+    struct epd_dev *epd = &ec->epd;
+    struct epd_file *ef;
+
+    if (READ_ONCE(ec->dead))
+        return -ENODEV;
+    ef = kzalloc(sizeof(*ef), GFP_KERNEL);
+    if (!ef)
+        return -ENOMEM;
+    ef->epd = epd;
+    ef->prio = EPD_PRIO_NORMAL;
+    // 只看打开之后完成的帧
+    ef->ev_next = READ_ONCE(epd->event_count);
+    filp->private_data = ef;
+
+    return 0;
+}
+
+// 读出刷新完成事件, 每次至少一条完整的 struct epd_event
+static ssize_t epd_read(struct file *filp, char __user *buf, 
+                          size_t count, loff_t *f_pos)
+{
+    struct epd_file *ef = filp->private_data;
+    struct epd_dev *epd = ef->epd;
+    struct epd_event ev;
+    ssize_t retval = 0;
+
+    if (count < sizeof(ev))
+        return -EINVAL;
+
+    while (count - retval >= sizeof(ev)) {
+        if (!EPD_ReadEvent(epd, &ef->ev_next, &ev)) {
+            if (retval)
+                break;
+            if (filp->f_flags & O_NONBLOCK)
+                return -EAGAIN;
+            if (wait_event_interruptible(epd->event_wait,
+                                         EPD_EventPending(epd, ef->ev_next) ||
+                                         READ_ONCE(EPD_Char(epd)->dead)))
+                return -ERESTARTSYS;
+            if (!EPD_EventPending(epd, ef->ev_next))
+                return -ENODEV;
+            continue;
+        }
+        if (copy_to_user(buf + retval, &ev, sizeof(ev)))
+            return retval ? retval : -EFAULT;
+        retval += sizeof(ev);
+    }
+    return retval;
+}
+
+static ssize_t epd_write_text(struct epd_file *ef, struct iov_iter *from) {
+    struct epd_dev *epd = ef->epd;
+    // 文字按终端方式追加, 一次最多收 MAX_CHAR_COUNT 个字符, 其余留给下一次 write()
+    size_t count = min_t(size_t, iov_iter_count(from), MAX_CHAR_COUNT);
+    char *text_buf;
+    
+    // 分配临时缓冲区
+    text_buf = kmalloc(count + 1, GFP_KERNEL);
+    if (!text_buf)
+        return -ENOMEM;
+    
+    // 从用户空间复制文本数据
+    if (!copy_from_iter_full(text_buf, count, from)) {
+        kfree(text_buf);
+        return -EFAULT;
+    }
+    text_buf[count] = '\0';
+    
+    // 渲染后放进帧信箱就返回, 不等刷新
+    mutex_lock(&epd->lock);
+    EPD_print(epd, text_buf, count);
+    EPD_SubmitFrame(epd, epd->refresh_mode, ef->prio);
+    mutex_unlock(&epd->lock);
+    
+    kfree(text_buf);
+    return count;
+}
+
+// 原始 1bpp 数据写进 display_buf 的 [ki_pos, ki_pos + count), 写到的字节就是脏区.
+// 写满一帧后位置回到 0, 连续 write() 就是连续的帧; pwrite() 只改一段.
+// splice/sendfile 时 from 直接指向管道页, 只拷贝这一次
+static ssize_t epd_write_frame(struct epd_file *ef, struct kiocb *iocb,
+                               struct iov_iter *from)
+{
+    struct epd_dev *epd = ef->epd;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    struct epd_rect r;
+
+    if (pos < 0)
+        return -EINVAL;
+    if (!count)
+        return 0;
+    if (pos >= EPD_FRAME_SIZE)
+        return -ENOSPC;
+    count = min_t(size_t, count, EPD_FRAME_SIZE - pos);
+
+    mutex_lock(&epd->lock);
+    count = copy_from_iter(epd->display_buf + pos, count, from);
+    if (!count) {
+        mutex_unlock(&epd->lock);
+        return -EFAULT;
+    }
+    if (EPD_ByteRect(pos, count, &r)) {
+        EPD_Damage(epd, &r);
+        EPD_SubmitFrame(epd, epd->refresh_mode, ef->prio);
+    }
+    mutex_unlock(&epd->lock);
+
+    pos += count;
+    iocb->ki_pos = pos == EPD_FRAME_SIZE ? 0 : pos;
+    return count;
+}
+
+static ssize_t epd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct epd_file *ef = iocb->ki_filp->private_data;
+    ssize_t ret;
+
+    if (!EPD_CharEnter(ef->epd))
+        return -ENODEV;
+    if (ef->mode == EPD_MODE_FRAME)
+        ret = epd_write_frame(ef, iocb, from);
+    else
+        ret = epd_write_text(ef, from);
+    EPD_CharExit(ef->epd);
+    return ret;
+}
+
+// 把 display_buf 直接映射给用户态, 绘制完用 EPD_IOC_FLUSH 提交.
+// 每页插入时加引用, 设备移除后映射里的页要到 munmap 才释放
+static int epd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct epd_file *ef = filp->private_data;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    unsigned long off;
+    int ret;
+
+    if (vma->vm_pgoff || len > EPD_FB_SIZE)
+        return -EINVAL;
+    // 私有映射写时会复制, 写不到 display_buf
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    if (!EPD_CharEnter(ef->epd))
+        return -ENODEV;
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    for (off = 0, ret = 0; off < len && !ret; off += PAGE_SIZE)
+        ret = vm_insert_page(vma, vma->vm_start + off,
+                             virt_to_page(ef->epd->display_buf + off));
+    EPD_CharExit(ef->epd);
+    return ret;
+}
+
+static const enum epd_refresh epd_flush_modes[] = {
+    [EPD_FLUSH_FULL] = EPD_REFRESH_FULL,
+    [EPD_FLUSH_PARTIAL] = EPD_REFRESH_PARTIAL,
+    [EPD_FLUSH_AUTO] = EPD_REFRESH_AUTO,
+    [EPD_FLUSH_CLEAR] = EPD_REFRESH_CLEAR,
+};
+
+// 把 struct epd_flush 解析成字节列矩形和刷新方式
+static int epd_flush_args(struct epd_dev *epd, struct epd_flush __user *arg,
+                          struct epd_rect *r, enum epd_refresh *mode)
+{
+    struct epd_flush fl;
+
+    if (copy_from_user(&fl, arg, sizeof(fl)))
+        return -EFAULT;
+    if (fl.mode >= ARRAY_SIZE(epd_flush_modes))
+        return -EINVAL;
+    *r = epd_full_rect;
+    if (fl.w && fl.h) {
+        if (fl.x >= EPD_2IN13_V2_WIDTH || fl.y >= EPD_2IN13_V2_HEIGHT)
+            return -EINVAL;
+        EPD_PixelRect(fl.x, fl.y,
+                      fl.x + min_t(u32, fl.w, EPD_2IN13_V2_WIDTH - fl.x) - 1,
+                      fl.y + min_t(u32, fl.h, EPD_2IN13_V2_HEIGHT - fl.y) - 1, r);
+    }
+    *mode = fl.mode == EPD_FLUSH_DEFAULT ? READ_ONCE(epd->refresh_mode)
+                                         : epd_flush_modes[fl.mode];
+    return 0;
+}
+
+static long epd_ioctl_flush(struct epd_file *ef, struct epd_flush __user *arg)
+{
+    struct epd_dev *epd = ef->epd;
+    struct epd_rect r;
+    enum epd_refresh mode;
+    int ret = epd_flush_args(epd, arg, &r, &mode);
+
+    if (ret)
+        return ret;
+    mutex_lock(&epd->lock);
+    EPD_Damage(epd, &r);
+    EPD_SubmitFrame(epd, mode, ef->prio);
+    mutex_unlock(&epd->lock);
+    return 0;
+}
+
+// 先写进控制器 RAM, 等 EPD_IOC_COMMIT 再刷新. 返回帧序号
+static long epd_ioctl_stage(struct epd_file *ef, struct epd_flush __user *arg)
+{
+    struct epd_dev *epd = ef->epd;
+    struct epd_rect r;
+    enum epd_refresh mode;
+    int ret = epd_flush_args(epd, arg, &r, &mode);
+
+    if (ret)
+        return ret;
+    mutex_lock(&epd->lock);
+    EPD_Damage(epd, &r);
+    mutex_unlock(&epd->lock);
+    return EPD_StageFrame(epd, mode, ef);
+}
+
+static long epd_ioctl_commit(struct epd_dev *epd, struct epd_commit __user *arg)
+{
+    struct epd_commit c;
+
+    if (copy_from_user(&c, arg, sizeof(c)))
+        return -EFAULT;
+    if (c.flags & ~EPD_COMMIT_ABORT)
+        return -EINVAL;
+    if (c.flags & EPD_COMMIT_ABORT)
+        return EPD_AbortStage(epd, NULL);
+    return EPD_CommitStage(epd, c.deadline_ns, c.clock);
+}
+
+// 一次系统调用贴完所有块; 带 EPD_BATCH_COMMIT 时合并脏区只刷一次
+static long epd_ioctl_update_batch(struct epd_file *ef,
+                                   struct epd_update_batch __user *arg)
+{
+    struct epd_dev *epd = ef->epd;
+    struct epd_update_batch ub;
+    struct epd_blit *blits;
+    uint8_t *src;
+    uint64_t end;
+    long ret = 0;
+    u32 i;
+
+    if (copy_from_user(&ub, arg, sizeof(ub)))
+        return -EFAULT;
+    if (ub.flags & ~EPD_BATCH_COMMIT || ub.mode >= ARRAY_SIZE(epd_flush_modes))
+        return -EINVAL;
+    if (!ub.count)
+        return 0;
+    if (ub.count > EPD_BATCH_MAX || ub.src_len > EPD_BATCH_SRC_MAX)
+        return -E2BIG;
+
+    blits = memdup_user(u64_to_user_ptr(ub.blits), ub.count * sizeof(*blits));
+    if (IS_ERR(blits))
+        return PTR_ERR(blits);
+    src = memdup_user(u64_to_user_ptr(ub.src), ub.src_len);
+    if (IS_ERR(src)) {
+        kfree(blits);
+        return PTR_ERR(src);
+    }
+
+    // 先整体检查, 不贴半批
+    for (i = 0; i < ub.count; i++) {
+        end = (uint64_t)blits[i].src_offset +
+              (uint64_t)DIV_ROUND_UP(blits[i].w, 8) * blits[i].h;
+        if (end > ub.src_len) {
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    mutex_lock(&epd->lock);
+    for (i = 0; i < ub.count; i++)
+        EPD_Blit(epd, blits[i].x, blits[i].y, blits[i].w, blits[i].h,
+                 src + blits[i].src_offset, DIV_ROUND_UP(blits[i].w, 8));
+    if (ub.flags & EPD_BATCH_COMMIT)
+        EPD_SubmitFrame(epd, ub.mode == EPD_FLUSH_DEFAULT ? epd->refresh_mode
+                                                          : epd_flush_modes[ub.mode],
+                        ef->prio);
+    mutex_unlock(&epd->lock);
+
+out:
+    kfree(src);
+    kfree(blits);
+    return ret;
+}
+
+static long epd_ioctl_set_mode(struct epd_file *ef, __u32 __user *arg)
+{
+    __u32 mode;
+
+    if (get_user(mode, arg))
+        return -EFAULT;
+    if (mode != EPD_MODE_TEXT && mode != EPD_MODE_FRAME)
+        return -EINVAL;
+    ef->mode = mode;
+    return 0;
+}
+
+// 改一个图层的一块区域; 带 EPD_LAYER_COMMIT 时把所有改过的区域合成进画布并提交
+static long epd_ioctl_layer_update(struct epd_file *ef,
+                                   struct epd_layer_update __user *arg)
+{
+    struct epd_dev *epd = ef->epd;
+    struct epd_layer_update lu;
+    uint8_t *bits = NULL, *mask = NULL;
+    unsigned int stride;
+    size_t len;
+    long ret;
+
+    if (copy_from_user(&lu, arg, sizeof(lu)))
+        return -EFAULT;
+    if (lu.layer >= EPD_LAYER_COUNT || lu.reserved ||
+        lu.flags & ~(EPD_LAYER_COMMIT | EPD_LAYER_CLEAR) ||
+        lu.mode >= ARRAY_SIZE(epd_flush_modes))
+        return -EINVAL;
+    if (lu.w > EPD_2IN13_V2_WIDTH || lu.h > EPD_2IN13_V2_HEIGHT)
+        return -EINVAL;
+
+    stride = DIV_ROUND_UP(lu.w, 8);
+    len = stride * lu.h;
+    if (len && !(lu.flags & EPD_LAYER_CLEAR)) {
+        bits = memdup_user(u64_to_user_ptr(lu.bits), len);
+        if (IS_ERR(bits))
+            return PTR_ERR(bits);
+        if (lu.layer && lu.mask) {
+            mask = memdup_user(u64_to_user_ptr(lu.mask), len);
+            if (IS_ERR(mask)) {
+                kfree(bits);
+                return PTR_ERR(mask);
+            }
+        }
+    }
+
+    mutex_lock(&epd->lock);
+    ret = EPD_LayerUpdate(epd, lu.layer, lu.x, lu.y, lu.w, lu.h, bits, mask, stride);
+    if (!ret && lu.flags & EPD_LAYER_COMMIT) {
+        EPD_LayerCompose(epd);
+        EPD_SubmitFrame(epd, lu.mode == EPD_FLUSH_DEFAULT ? epd->refresh_mode
+                                                          : epd_flush_modes[lu.mode],
+                        ef->prio);
+    }
+    mutex_unlock(&epd->lock);
+
+    kfree(mask);
+    kfree(bits);
+    return ret;
+}
+
+static long epd_ioctl_set_prio(struct epd_file *ef, __u32 __user *arg)
+{
+    __u32 prio;
+
+    if (get_user(prio, arg))
+        return -EFAULT;
+    if (prio >= EPD_PRIO_COUNT)
+        return -EINVAL;
+    ef->prio = prio;
+    return 0;
+}
+
+// 字体属于整块屏的文字网格; 真正换了字体时擦掉原有文字并刷新
+static long epd_ioctl_set_font(struct epd_file *ef, __u32 __user *arg)
+{
+    struct epd_dev *epd = ef->epd;
+    __u32 font;
+
+    if (get_user(font, arg))
+        return -EFAULT;
+    if (font >= EPD_FONT_COUNT)
+        return -EINVAL;
+    mutex_lock(&epd->lock);
+    if (EPD_TextSetFont(epd, font))
+        EPD_SubmitFrame(epd, epd->refresh_mode, ef->prio);
+    mutex_unlock(&epd->lock);
+    return 0;
+}
+
+static long epd_do_ioctl(struct epd_file *ef, unsigned int cmd, unsigned long arg)
+{
+    switch (cmd) {
+    case EPD_IOC_FLUSH:
+        return epd_ioctl_flush(ef, (struct epd_flush __user *)arg);
+    case EPD_IOC_SET_MODE:
+        return epd_ioctl_set_mode(ef, (__u32 __user *)arg);
+    case EPD_IOC_STAGE:
+        return epd_ioctl_stage(ef, (struct epd_flush __user *)arg);
+    case EPD_IOC_COMMIT:
+        return epd_ioctl_commit(ef->epd, (struct epd_commit __user *)arg);
+    case EPD_IOC_UPDATE_BATCH:
+        return epd_ioctl_update_batch(ef, (struct epd_update_batch __user *)arg);
+    case EPD_IOC_LAYER_UPDATE:
+        return epd_ioctl_layer_update(ef, (struct epd_layer_update __user *)arg);
+    case EPD_IOC_SET_PRIO:
+        return epd_ioctl_set_prio(ef, (__u32 __user *)arg);
+    case EPD_IOC_SET_FONT:
+        return epd_ioctl_set_font(ef, (__u32 __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+static long epd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct epd_file *ef = filp->private_data;
+    long ret;
+
+    if (!EPD_CharEnter(ef->epd))
+        return -ENODEV;
+    ret = epd_do_ioctl(ef, cmd, arg);
+    EPD_CharExit(ef->epd);
+    return ret;
+}
+
+// POLLOUT: 信箱空着, 这次提交不会覆盖还没刷的帧
+// POLLIN/POLLPRI: 有没读的刷新完成事件
+static __poll_t epd_poll(struct file *filp, poll_table *wait)
+{
+    struct epd_file *ef = filp->private_data;
+    struct epd_dev *epd = ef->epd;
+    __poll_t mask = 0;
+
+    poll_wait(filp, &epd->event_wait, wait);
+    if (READ_ONCE(EPD_Char(epd)->dead))
+        return EPOLLHUP | EPOLLERR;
+    if (!READ_ONCE(epd->pending))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    if (EPD_EventPending(epd, ef->ev_next))
+        mask |= EPOLLIN | EPOLLRDNORM | EPOLLPRI;
+    return mask;
+}
+
+static int epd_fasync(int fd, struct file *filp, int on)
+{
+    struct epd_file *ef = filp->private_data;
+
+    return fasync_helper(fd, filp, on, &ef->epd->fasync);
+}
+
+static void EPD_UringCancelAll(struct epd_dev *epd, struct file *filp);
+
+static int epd_release(struct inode *inode, struct file *filp) {
+    struct epd_file *ef = filp->private_data;
+
+    pr_info("closing epd char device\n");
+    epd_fasync(-1, filp, 0);
+    // 暂存了却没提交就关掉, 放弃暂存帧, 不然信箱会一直停着
+    if (EPD_CharEnter(ef->epd)) {
+        EPD_AbortStage(ef->epd, ef);
+        EPD_CharExit(ef->epd);
+    }
+    EPD_UringCancelAll(ef->epd, filp);
+    kfree(ef);
+    return 0;
+}
+
+// 文件位置即显存偏移, 范围 [0, EPD_FRAME_SIZE]
+static loff_t epd_llseek(struct file *filp, loff_t offset, int whence)
+{
+    loff_t new_pos;
+
+    switch (whence) {
+    case SEEK_SET:  // 从文件开始处定位
+        new_pos = offset;
+        break;
+    case SEEK_CUR:  // 从当前位置定位
+        new_pos = filp->f_pos + offset;
+        break;
+    case SEEK_END:  // 从显存末尾定位
+        new_pos = EPD_FRAME_SIZE + offset;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (new_pos < 0 || new_pos > EPD_FRAME_SIZE)
+        return -EINVAL;
+
+    filp->f_pos = new_pos;
+    return new_pos;
+}
+
+/* io_uring: 一个环可以同时驱动多块屏的多次更新, 不占线程 */
+// 放在 io_uring_cmd 的 pdu 里, 挂在 frame_waiters 上等帧刷完.
+// queued 由 event_lock 保护, 从队列上摘下的一方负责完成它
+struct epd_uring_pdu {
+    struct list_head node;
+    struct io_uring_cmd *ioucmd;
+    uint32_t seq;
+    bool queued;
+};
+
+static inline struct epd_uring_pdu *EPD_UringPdu(struct io_uring_cmd *ioucmd)
+{
+    BUILD_BUG_ON(sizeof(struct epd_uring_pdu) > sizeof(ioucmd->pdu));
+    return (struct epd_uring_pdu *)ioucmd->pdu;
+}
+
+static void EPD_UringDoneTask(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    io_uring_cmd_done(ioucmd, EPD_UringPdu(ioucmd)->seq, 0, issue_flags);
+}
+
+static void EPD_UringCancelTask(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    io_uring_cmd_done(ioucmd, -ECANCELED, 0, issue_flags);
+}
+
+// 刷新线程每完成一帧调用: 序号不超过它的请求都已上屏
+static void EPD_UringFrameDone(struct epd_dev *epd, const struct epd_event *ev)
+{
+    struct epd_uring_pdu *pdu, *tmp;
+    LIST_HEAD(done);
+
+    spin_lock(&epd->event_lock);
+    list_for_each_entry_safe(pdu, tmp, &epd->frame_waiters, node) {
+        if ((int32_t)(ev->seq - pdu->seq) >= 0) {
+            pdu->queued = false;
+            list_move_tail(&pdu->node, &done);
+        }
+    }
+    spin_unlock(&epd->event_lock);
+
+    list_for_each_entry_safe(pdu, tmp, &done, node) {
+        list_del(&pdu->node);
+        io_uring_cmd_complete_in_task(pdu->ioucmd, EPD_UringDoneTask);
+    }
+}
+
+// 挂到等待队列; 这一帧已经刷完时 (刷新线程比我们快) 返回 false
+static bool EPD_UringWait(struct epd_dev *epd, struct io_uring_cmd *ioucmd,
+                          uint32_t seq)
+{
+    struct epd_uring_pdu *pdu = EPD_UringPdu(ioucmd);
+    uint32_t last;
+    bool queued = true;
+
+    pdu->seq = seq;
+    spin_lock(&epd->event_lock);
+    if (epd->event_count) {
+        last = epd->events[(epd->event_count - 1) % EPD_EVENT_RING].seq;
+        queued = (int32_t)(last - seq) < 0;
+    }
+    pdu->queued = queued;
+    if (queued)
+        list_add_tail(&pdu->node, &epd->frame_waiters);
+    spin_unlock(&epd->event_lock);
+    return queued;
+}
+
+// 环拆除时 (IO_URING_F_CANCEL) 取消一个还在等的请求. 已被刷新线程摘走的由它完成
+static void EPD_UringCancel(struct epd_dev *epd, struct io_uring_cmd *ioucmd,
+                            unsigned int issue_flags)
+{
+    struct epd_uring_pdu *pdu = EPD_UringPdu(ioucmd);
+    bool queued;
+
+    spin_lock(&epd->event_lock);
+    queued = pdu->queued;
+    if (queued) {
+        pdu->queued = false;
+        list_del(&pdu->node);
+    }
+    spin_unlock(&epd->event_lock);
+    if (queued)
+        io_uring_cmd_done(ioucmd, -ECANCELED, 0, issue_flags);
+}
+
+// 文件关闭或设备移除时, 还在等的请求 (filp 为 NULL 时全部) 以 -ECANCELED 结束.
+// 例如暂存后一直没有提交的帧
+static void EPD_UringCancelAll(struct epd_dev *epd, struct file *filp)
+{
+    struct epd_uring_pdu *pdu, *tmp;
+    LIST_HEAD(cancel);
+
+    spin_lock(&epd->event_lock);
+    list_for_each_entry_safe(pdu, tmp, &epd->frame_waiters, node) {
+        if (filp && pdu->ioucmd->file != filp)
+            continue;
+        pdu->queued = false;
+        list_move_tail(&pdu->node, &cancel);
+    }
+    spin_unlock(&epd->event_lock);
+
+    list_for_each_entry_safe(pdu, tmp, &cancel, node) {
+        list_del(&pdu->node);
+        io_uring_cmd_complete_in_task(pdu->ioucmd, EPD_UringCancelTask);
+    }
+}
+
+static int epd_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    struct epd_file *ef = ioucmd->file->private_data;
+    struct epd_dev *epd = ef->epd;
+    struct epd_char *ec = EPD_Char(epd);
+    struct epd_uring_pdu *pdu;
+    struct epd_uring_cmd c;
+    struct epd_rect r = epd_full_rect;
+    enum epd_refresh mode;
+    uint32_t seq;
+    int ret;
+
+    if (issue_flags & IO_URING_F_CANCEL) {
+        EPD_UringCancel(epd, ioucmd, issue_flags);
+        return 0;
+    }
+
+    // sqe 在用户态共享内存里, 先拷一份再检查
+    memcpy(&c, io_uring_sqe_cmd(ioucmd->sqe), sizeof(c));
+    if (c.mode >= ARRAY_SIZE(epd_flush_modes) || c.reserved)
+        return -EINVAL;
+    if (c.offset > EPD_FRAME_SIZE || c.len > EPD_FRAME_SIZE - c.offset)
+        return -EINVAL;
+    if (c.len)
+        EPD_ByteRect(c.offset, c.len, &r);
+
+    switch (ioucmd->cmd_op) {
+    case EPD_URING_WRITE:
+        if (!c.len)
+            return -EINVAL;
+        break;
+    case EPD_URING_FLUSH:
+        break;
+    default:
+        return -ENOTTY;
+    }
+
+    // 不能睡的提交上下文里拿不到锁, 交给 io-wq 重试
+    if (issue_flags & IO_URING_F_NONBLOCK) {
+        if (!down_read_trylock(&ec->remove_sem))
+            return -EAGAIN;
+        if (!mutex_trylock(&epd->lock)) {
+            up_read(&ec->remove_sem);
+            return -EAGAIN;
+        }
+    } else {
+        down_read(&ec->remove_sem);
+        mutex_lock(&epd->lock);
+    }
+    if (ec->dead) {
+        ret = -ENODEV;
+        goto out;
+    }
+    if (ioucmd->cmd_op == EPD_URING_WRITE &&
+        copy_from_user(epd->display_buf + c.offset, u64_to_user_ptr(c.addr), c.len)) {
+        ret = -EFAULT;
+        goto out;
+    }
+    mode = c.mode == EPD_FLUSH_DEFAULT ? epd->refresh_mode : epd_flush_modes[c.mode];
+    EPD_Damage(epd, &r);
+    seq = EPD_SubmitFrame(epd, mode, ef->prio);
+    ret = 0;
+out:
+    mutex_unlock(&epd->lock);
+    up_read(&ec->remove_sem);
+    if (ret)
+        return ret;
+
+    // 先登记为可取消, 环拆除时才能收回一直等不到的请求. pdu 在未初始化的
+    // ioucmd->pdu 里, 登记前先标成没排队: io-wq 重试时 mark 会放开 uring_lock,
+    // 取消可能赶在 EPD_UringWait 之前到, 这时什么也不做, 之后会再来取消
+    pdu = EPD_UringPdu(ioucmd);
+    pdu->ioucmd = ioucmd;
+    pdu->queued = false;
+    io_uring_cmd_mark_cancelable(ioucmd, issue_flags);
+    if (!EPD_UringWait(epd, ioucmd, seq))
+        io_uring_cmd_done(ioucmd, seq, 0, issue_flags);
+    return -EIOCBQUEUED;
+}
+
+static const struct file_operations epd_fops = {
+    .owner = THIS_MODULE,
+    .open = epd_open,
+    .read = epd_read,
+    .write_iter = epd_write_iter,
+    .splice_write = iter_file_splice_write,
+    .poll = epd_poll,
+    .mmap = epd_mmap,
+    .unlocked_ioctl = epd_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .fasync = epd_fasync,
+    .uring_cmd = epd_uring_cmd,
+    .release = epd_release,
+    .llseek = epd_llseek,
+};
+
+/* sysfs */
+static ssize_t xfer_stats_show(struct device *dev,
+                               struct device_attribute *attr, char *buf)
+{
+    struct epd_dev *epd = dev_get_drvdata(dev);
+    struct epd_xfer_stats *st = &epd->stats;
+
+    return sysfs_emit(buf, "cmds %u\ndata_bytes %u\ntransfers %u\nsaved %u\n",
+                      st->cmds, st->data_bytes, st->transfers,
+                      st->cmds + st->data_bytes - st->transfers);
+}
+static DEVICE_ATTR_RO(xfer_stats);
+
+static const char * const epd_refresh_names[] = {
+    [EPD_REFRESH_FULL] = "full",
+    [EPD_REFRESH_PARTIAL] = "partial",
+    [EPD_REFRESH_AUTO] = "auto",
+    [EPD_REFRESH_CLEAR] = "clear",
+};
+
+static ssize_t refresh_mode_show(struct device *dev,
+                                 struct device_attribute *attr, char *buf)
+{
+    struct epd_dev *epd = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%s\n", epd_refresh_names[epd->refresh_mode]);
+}
+
+static ssize_t refresh_mode_store(struct device *dev,
+                                  struct device_attribute *attr,
+                                  const char *buf, size_t count)
+{
+    struct epd_dev *epd = dev_get_drvdata(dev);
+    int mode = sysfs_match_string(epd_refresh_names, buf);
+
+    if (mode < 0)
+        return mode;
+    epd->refresh_mode = mode;
+    return count;
+}
+static DEVICE_ATTR_RW(refresh_mode);
+
+static ssize_t refresh_stats_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf)
+{
+    struct epd_dev *epd = dev_get_drvdata(dev);
+    struct epd_refresh_stats *st = &epd->rstats;
+    int i, len;
+
+    // 只读计数, 不必等正在进行的刷新
+    len = sysfs_emit(buf, "full %u\npartial %u\ncleanups %u\npartials_since_full %u\nband_flips",
+                     st->full, st->partial, st->cleanups, st->partials_since_full);
+    for (i = 0; i < EPD_GHOST_BANDS; i++)
+        len += sysfs_emit_at(buf, len, " %u", st->band_flips[i]);
+    len += sysfs_emit_at(buf, len, "\n");
+    return len;
+}
+static DEVICE_ATTR_RO(refresh_stats);
+
+static ssize_t frame_stats_show(struct device *dev,
+                                struct device_attribute *attr, char *buf)
+{
+    struct epd_dev *epd = dev_get_drvdata(dev);
+    struct epd_frame_stats st;
+    bool pending;
+
+    mutex_lock(&epd->lock);
+    st = epd->fstats;
+    pending = epd->pending != NULL;
+    mutex_unlock(&epd->lock);
+    return sysfs_emit(buf, "pending %d\nsubmitted %u\ncoalesced %u\ndisplayed %u\n",
+                      pending, st.submitted, st.coalesced, st.displayed);
+}
+static DEVICE_ATTR_RO(frame_stats);
+
+// 刷新策略的各项阈值. 每项都是独立的一个字, 直接原子地读写,
+// 不去拿 hw_lock, 否则写 sysfs 要等一整次刷新
+#define EPD_POLICY_ATTR(_name)                                              \
+static ssize_t _name##_show(struct device *dev,                             \
+                            struct device_attribute *attr, char *buf)       \
+{                                                                           \
+    struct epd_dev *epd = dev_get_drvdata(dev);                             \
+                                                                            \
+    return sysfs_emit(buf, "%u\n", READ_ONCE(epd->policy._name));           \
+}                                                                           \
+static ssize_t _name##_store(struct device *dev,                            \
+                             struct device_attribute *attr,                 \
+                             const char *buf, size_t count)                 \
+{                                                                           \
+    struct epd_dev *epd = dev_get_drvdata(dev);                             \
+    unsigned int val;                                                       \
+    int ret = kstrtouint(buf, 0, &val);                                     \
+                                                                            \
+    if (ret)                                                                \
+        return ret;                                                         \
+    WRITE_ONCE(epd->policy._name, val);                                     \
+    return count;                                                           \
+}                                                                           \
+static DEVICE_ATTR_RW(_name)
+
+EPD_POLICY_ATTR(max_partials);
+EPD_POLICY_ATTR(full_diff_pct);
+EPD_POLICY_ATTR(ghost_budget);
+EPD_POLICY_ATTR(cleanup_partials);
+EPD_POLICY_ATTR(idle_ms);
+EPD_POLICY_ATTR(refresh_interval_ms);
+EPD_POLICY_ATTR(refresh_burst);
+
+static const char * const epd_prio_names[] = {
+    [EPD_PRIO_BACKGROUND] = "background",
+    [EPD_PRIO_NORMAL] = "normal",
+    [EPD_PRIO_URGENT] = "urgent",
+};
+
+// 每个优先级一行: 提交数, 上屏数, 平均/最大延迟 (us)
+static ssize_t qos_stats_show(struct device *dev,
+                              struct device_attribute *attr, char *buf)
+{
+    struct epd_dev *epd = dev_get_drvdata(dev);
+    struct epd_qos_stats st[EPD_PRIO_COUNT];
+    uint32_t throttled;
+    int i, len;
+
+    mutex_lock(&epd->lock);
+    memcpy(st, epd->qstats, sizeof(st));
+    throttled = epd->throttled;
+    mutex_unlock(&epd->lock);
+
+    len = sysfs_emit(buf, "throttled %u\n", throttled);
+    for (i = 0; i < EPD_PRIO_COUNT; i++)
+        len += sysfs_emit_at(buf, len, "%s submitted %u displayed %u avg_us %llu max_us %llu\n",
+                             epd_prio_names[i], st[i].submitted, st[i].displayed,
+                             st[i].displayed ? div64_u64(st[i].latency_total_ns,
+                                                         (u64)st[i].displayed * NSEC_PER_USEC) : 0,
+                             div_u64(st[i].latency_max_ns, NSEC_PER_USEC));
+    return len;
+}
+static DEVICE_ATTR_RO(qos_stats);
+
+static struct attribute *epd_attrs[] = {
+    &dev_attr_xfer_stats.attr,
+    &dev_attr_refresh_mode.attr,
+    &dev_attr_refresh_stats.attr,
+    &dev_attr_frame_stats.attr,
+    &dev_attr_max_partials.attr,
+    &dev_attr_full_diff_pct.attr,
+    &dev_attr_ghost_budget.attr,
+    &dev_attr_cleanup_partials.attr,
+    &dev_attr_idle_ms.attr,
+    &dev_attr_refresh_interval_ms.attr,
+    &dev_attr_refresh_burst.attr,
+    &dev_attr_qos_stats.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(epd);
+
+/* Module Load / Unload*/
+static struct class *epd_class;
+
+// 最后一个引用 (设备本身或打开的文件) 放掉时才释放
+static void EPD_CharFree(struct device *dev)
+{
+    kfree(container_of(dev, struct epd_char, dev));
+}
+
+// 设备本身的那份引用排在 devres 的最后放掉, BUSY 中断这些 devm 资源先释放
+static void EPD_CharPut(void *data)
+{
+    struct epd_char *ec = data;
+
+    put_device(&ec->dev);
+}
+
+static int epd_probe(struct spi_device *spi)
+{
+    pr_info("epd probe");
+    struct device *dev = &spi->dev;
+    struct epd_char *ec;
+    struct epd_dev *epd;
+    int ret;
+
+    // init spi device. 不用 devm 分配: 设备移除后打开的文件还引用着它
+    ec = kzalloc(sizeof(*ec), GFP_KERNEL);
+    if (!ec)
+        return -ENOMEM;
+    epd = &ec->epd;
+    init_rwsem(&ec->remove_sem);
+    device_initialize(&ec->dev);
+    ec->dev.release = EPD_CharFree;
+    ret = devm_add_action_or_reset(dev, EPD_CharPut, ec);
+    if (ret)
+        return ret;
+
+    spi_set_drvdata(spi, ec);
+    ret = EPD_Setup(epd, spi);
+    if (ret < 0)
+        return ret;
+    epd->frame_done = EPD_UringFrameDone;
+
+    // register char device
+    ret = alloc_chrdev_region(&ec->dev.devt, 0, 1, "epd");
+    if (ret < 0)
+        goto err_release;
+
+    ec->dev.class = epd_class;
+    ec->dev.parent = dev;
+    ec->dev.groups = epd_groups;
+    dev_set_drvdata(&ec->dev, epd);
+    ret = dev_set_name(&ec->dev, "epd%d", 0);
+    if (ret)
+        goto err_region;
+
+    cdev_init(&ec->cdev, &epd_fops);
+    ec->cdev.owner = THIS_MODULE;
+    ret = cdev_device_add(&ec->cdev, &ec->dev);
+    if (ret < 0) {
+        pr_err("Failed to register char device\n");
+        goto err_region;
+    }
+
+    // 没有 fbdev 也不影响 /dev/epd0
+    if (EPD_FbRegister(ec, dev))
+        dev_warn(dev, "no framebuffer, char device only\n");
+    
+    return 0;
+
+err_region:
+    unregister_chrdev_region(ec->dev.devt, 1);
+err_release:
+    EPD_Release(epd);
+    return ret;
+}
+
+/* 清理: 先让新的打开和 sysfs 访问失败, 再等进行中的文件操作退出, 最后拆核心 */
+static void epd_remove(struct spi_device *spi)
+{
+    pr_info("epd remove");
+    struct epd_char *ec = spi_get_drvdata(spi);
+    struct epd_dev *epd = &ec->epd;
+    // fbdev 最后一批脏页也会进信箱
+    EPD_FbUnregister(ec);
+    cdev_device_del(&ec->cdev, &ec->dev);
+
+    down_write(&ec->remove_sem);
+    ec->dead = true;
+    up_write(&ec->remove_sem);
+    // 还在 read()/poll() 里等的文件醒来看到 dead
+    wake_up_all(&epd->event_wait);
+
+    EPD_Release(epd);
+    // 刷新线程已停, 剩下的 io_uring 等待者再也等不到帧了
+    EPD_UringCancelAll(epd, NULL);
+    EPD_LayerFree(epd);
+
+    unregister_chrdev_region(ec->dev.devt, 1);
+}
+
+/* of_match_table */
+static const struct of_device_id epd_of_match[] = {
+    { .compatible = "waveshare,epd2in13v2" },
+    { /* sentinel */ }
+};
+MODULE_DEVICE_TABLE(of, epd_of_match);
+
+/* 注册 spi_driver，使用 of_match_table */
+static struct spi_driver epd_spi_driver = {
+    .driver = {
+        .name = "epd2in13v2",
+        .of_match_table = epd_of_match,
+    },
+    .probe = epd_probe,
+    .remove = epd_remove,
+};
+
+
+static int __init my_init(void)
+{
+    int ret;
+
+    pr_info("init epd module");
+    epd_class = class_create("epd");
+    if (IS_ERR(epd_class))
+        return PTR_ERR(epd_class);
+
+    ret = spi_register_driver(&epd_spi_driver);
+    if (ret < 0) {
+	pr_info("can't register epd spi device. exiting ...");
+        class_destroy(epd_class);
+        return ret;
+    }
+
+    return 0;
+}
+
+static void __exit my_exit(void)
+{
+    spi_unregister_driver(&epd_spi_driver);
+    class_destroy(epd_class);
+}
+
+module_init(my_init);
+module_exit(my_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("ck");
+MODULE_DESCRIPTION("Waveshare 2.13inch V2 EPD char device driver");
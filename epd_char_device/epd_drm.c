@@ -0,0 +1,327 @@
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/delay.h>
+#include <linux/of.h>
+#include <linux/of_device.h>
+#include <linux/spi/spi.h>
+#include <linux/gpio/consumer.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/dma-mapping.h>
+
+#include <drm/drm_atomic_helper.h>
+#include <drm/drm_connector.h>
+#include <drm/drm_damage_helper.h>
+#include <drm/drm_drv.h>
+#include <drm/drm_fb_dma_helper.h>
+#include <drm/drm_fbdev_generic.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_framebuffer.h>
+#include <drm/drm_gem_atomic_helper.h>
+#include <drm/drm_gem_dma_helper.h>
+#include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_managed.h>
+#include <drm/drm_modes.h>
+#include <drm/drm_probe_helper.h>
+#include <drm/drm_simple_kms_helper.h>
+
+#include "epd_2in13v2.h"
+
+/**
+* KMS 接口: 一个 simple display pipe, 面板竖放 122x250.
+* 与 epd_char_device 绑定同一个 compatible, 两者只加载其一
+**/
+struct epd_drm {
+    struct drm_device drm;
+    struct drm_simple_display_pipe pipe;
+    struct drm_connector connector;
+    struct drm_display_mode mode;
+    struct epd_dev epd;
+};
+
+static inline struct epd_drm *drm_to_epd(struct drm_device *drm)
+{
+    return container_of(drm, struct epd_drm, drm);
+}
+
+static const uint32_t epd_drm_formats[] = {
+    DRM_FORMAT_XRGB8888,
+    DRM_FORMAT_R8,
+};
+
+static const struct drm_display_mode epd_drm_mode = {
+    DRM_SIMPLE_MODE(EPD_2IN13_V2_WIDTH, EPD_2IN13_V2_HEIGHT, 23, 48),
+};
+
+// 亮度 >= 128 为白 (1). 0.299R + 0.587G + 0.114B, 放大 256 倍
+static inline uint8_t EPD_XrgbBit(uint32_t px)
+{
+    return ((px >> 16 & 0xFF) * 77 + (px >> 8 & 0xFF) * 150 +
+            (px & 0xFF) * 29) >= 128 * 256;
+}
+
+// 一行里 [bx0, bx1) 这几个字节列: 每 8 个像素在寄存器里拼成一个字节再写,
+// 超出 fb 宽度的填充位写白
+static void EPD_ConvXrgbLine(uint8_t *dst, const uint32_t *src, unsigned int w,
+                             unsigned int bx0, unsigned int bx1)
+{
+    unsigned int bx, i, x;
+    uint8_t b;
+
+    for (bx = bx0; bx < bx1; bx++) {
+        x = bx * 8;
+        if (x + 8 <= w) {
+            const uint32_t *p = src + x;
+
+            b = EPD_XrgbBit(p[0]) << 7 | EPD_XrgbBit(p[1]) << 6 |
+                EPD_XrgbBit(p[2]) << 5 | EPD_XrgbBit(p[3]) << 4 |
+                EPD_XrgbBit(p[4]) << 3 | EPD_XrgbBit(p[5]) << 2 |
+                EPD_XrgbBit(p[6]) << 1 | EPD_XrgbBit(p[7]);
+        } else {
+            b = 0;
+            for (i = 0; i < 8; i++)
+                b |= (x + i >= w || EPD_XrgbBit(src[x + i])) << (7 - i);
+        }
+        dst[bx] = b;
+    }
+}
+
+static void EPD_ConvR8Line(uint8_t *dst, const uint8_t *src, unsigned int w,
+                           unsigned int bx0, unsigned int bx1)
+{
+    unsigned int bx, i, x;
+    uint8_t b;
+
+    for (bx = bx0; bx < bx1; bx++) {
+        x = bx * 8;
+        if (x + 8 <= w) {
+            const uint8_t *p = src + x;
+
+            b = (p[0] >> 7) << 7 | (p[1] >> 7) << 6 | (p[2] >> 7) << 5 |
+                (p[3] >> 7) << 4 | (p[4] >> 7) << 3 | (p[5] >> 7) << 2 |
+                (p[6] >> 7) << 1 | (p[7] >> 7);
+        } else {
+            b = 0;
+            for (i = 0; i < 8; i++)
+                b |= (x + i >= w || src[x + i] >= 128) << (7 - i);
+        }
+        dst[bx] = b;
+    }
+}
+
+// 把 fb 中 clip 覆盖的字节列转成 1bpp 写进 display_buf, 记为脏区并提交一帧
+static int EPD_DrmDirty(struct epd_dev *epd, struct drm_framebuffer *fb,
+                        const struct drm_rect *clip, enum epd_refresh mode)
+{
+    struct drm_gem_dma_object *dma_obj = drm_fb_dma_get_gem_obj(fb, 0);
+    const uint8_t *vaddr = (const uint8_t *)dma_obj->vaddr + fb->offsets[0];
+    struct epd_rect r;
+    unsigned int y;
+    int ret;
+
+    if (!EPD_PixelRect(clip->x1, clip->y1, clip->x2 - 1, clip->y2 - 1, &r))
+        return 0;
+
+    ret = drm_gem_fb_begin_cpu_access(fb, DMA_FROM_DEVICE);
+    if (ret)
+        return ret;
+
+    mutex_lock(&epd->lock);
+    for (y = r.y0; y < r.y1; y++) {
+        uint8_t *dst = epd->display_buf + y * WIDTH;
+        const uint8_t *src = vaddr + y * fb->pitches[0];
+
+        if (fb->format->format == DRM_FORMAT_R8)
+            EPD_ConvR8Line(dst, src, fb->width, r.x0, r.x1);
+        else
+            EPD_ConvXrgbLine(dst, (const uint32_t *)src, fb->width, r.x0, r.x1);
+    }
+    EPD_Damage(epd, &r);
+    EPD_SubmitFrame(epd, mode, EPD_PRIO_NORMAL);
+    mutex_unlock(&epd->lock);
+
+    drm_gem_fb_end_cpu_access(fb, DMA_FROM_DEVICE);
+    return 0;
+}
+
+static void epd_pipe_enable(struct drm_simple_display_pipe *pipe,
+                            struct drm_crtc_state *crtc_state,
+                            struct drm_plane_state *plane_state)
+{
+    struct epd_drm *edrm = drm_to_epd(pipe->crtc.dev);
+    struct drm_framebuffer *fb = plane_state->fb;
+    struct drm_rect full = DRM_RECT_INIT(0, 0, fb->width, fb->height);
+    int idx;
+
+    if (!drm_dev_enter(&edrm->drm, &idx))
+        return;
+    // 开屏整帧全刷一次, 之后按脏区
+    EPD_DrmDirty(&edrm->epd, fb, &full, EPD_REFRESH_FULL);
+    drm_dev_exit(idx);
+}
+
+static void epd_pipe_disable(struct drm_simple_display_pipe *pipe)
+{
+    struct epd_drm *edrm = drm_to_epd(pipe->crtc.dev);
+
+    // 电子纸断电后画面保持, 只等排队的帧刷完
+    flush_workqueue(edrm->epd.wq);
+}
+
+// 合并所有 FB_DAMAGE_CLIPS, 只转换和上传这一块; 全刷还是局刷交给刷新策略
+static void epd_pipe_update(struct drm_simple_display_pipe *pipe,
+                            struct drm_plane_state *old_state)
+{
+    struct epd_drm *edrm = drm_to_epd(pipe->crtc.dev);
+    struct drm_plane_state *state = pipe->plane.state;
+    struct drm_rect rect;
+    int idx;
+
+    if (!pipe->crtc.state->active || !state->fb)
+        return;
+    if (!drm_atomic_helper_damage_merged(old_state, state, &rect))
+        return;
+    if (!drm_dev_enter(&edrm->drm, &idx))
+        return;
+    EPD_DrmDirty(&edrm->epd, state->fb, &rect, edrm->epd.refresh_mode);
+    drm_dev_exit(idx);
+}
+
+static const struct drm_simple_display_pipe_funcs epd_pipe_funcs = {
+    .enable = epd_pipe_enable,
+    .disable = epd_pipe_disable,
+    .update = epd_pipe_update,
+};
+
+static int epd_connector_get_modes(struct drm_connector *connector)
+{
+    struct epd_drm *edrm = drm_to_epd(connector->dev);
+
+    return drm_connector_helper_get_modes_fixed(connector, &edrm->mode);
+}
+
+static const struct drm_connector_helper_funcs epd_connector_hfuncs = {
+    .get_modes = epd_connector_get_modes,
+};
+
+static const struct drm_connector_funcs epd_connector_funcs = {
+    .reset = drm_atomic_helper_connector_reset,
+    .fill_modes = drm_helper_probe_single_connector_modes,
+    .destroy = drm_connector_cleanup,
+    .atomic_duplicate_state = drm_atomic_helper_connector_duplicate_state,
+    .atomic_destroy_state = drm_atomic_helper_connector_destroy_state,
+};
+
+static const struct drm_mode_config_funcs epd_mode_config_funcs = {
+    .fb_create = drm_gem_fb_create_with_dirty,
+    .atomic_check = drm_atomic_helper_check,
+    .atomic_commit = drm_atomic_helper_commit,
+};
+
+DEFINE_DRM_GEM_DMA_FOPS(epd_drm_fops);
+
+static const struct drm_driver epd_drm_driver = {
+    .driver_features = DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC,
+    .fops = &epd_drm_fops,
+    DRM_GEM_DMA_DRIVER_OPS_VMAP,
+    .name = "epd2in13v2",
+    .desc = "Waveshare 2.13inch V2 e-Paper",
+    .date = "20251122",
+    .major = 1,
+    .minor = 0,
+};
+
+static int epd_drm_probe(struct spi_device *spi)
+{
+    struct device *dev = &spi->dev;
+    struct epd_drm *edrm;
+    struct drm_device *drm;
+    int ret;
+
+    edrm = devm_drm_dev_alloc(dev, &epd_drm_driver, struct epd_drm, drm);
+    if (IS_ERR(edrm))
+        return PTR_ERR(edrm);
+    drm = &edrm->drm;
+    spi_set_drvdata(spi, drm);
+
+    // SPI 设备默认没有 DMA 掩码, GEM DMA 的 dumb buffer 分配会失败
+    ret = dma_coerce_mask_and_coherent(dev, DMA_BIT_MASK(32));
+    if (ret)
+        return ret;
+
+    ret = EPD_Setup(&edrm->epd, spi);
+    if (ret < 0)
+        return ret;
+
+    ret = drmm_mode_config_init(drm);
+    if (ret)
+        goto err_release;
+    drm->mode_config.min_width = EPD_2IN13_V2_WIDTH;
+    drm->mode_config.max_width = EPD_2IN13_V2_WIDTH;
+    drm->mode_config.min_height = EPD_2IN13_V2_HEIGHT;
+    drm->mode_config.max_height = EPD_2IN13_V2_HEIGHT;
+    drm->mode_config.funcs = &epd_mode_config_funcs;
+
+    drm_mode_copy(&edrm->mode, &epd_drm_mode);
+    drm_connector_helper_add(&edrm->connector, &epd_connector_hfuncs);
+    ret = drm_connector_init(drm, &edrm->connector, &epd_connector_funcs,
+                             DRM_MODE_CONNECTOR_SPI);
+    if (ret)
+        goto err_release;
+
+    ret = drm_simple_display_pipe_init(drm, &edrm->pipe, &epd_pipe_funcs,
+                                       epd_drm_formats, ARRAY_SIZE(epd_drm_formats),
+                                       NULL, &edrm->connector);
+    if (ret)
+        goto err_release;
+    drm_plane_enable_fb_damage_clips(&edrm->pipe.plane);
+
+    drm_mode_config_reset(drm);
+
+    ret = drm_dev_register(drm, 0);
+    if (ret)
+        goto err_release;
+
+    drm_fbdev_generic_setup(drm, 0);
+    return 0;
+
+err_release:
+    EPD_Release(&edrm->epd);
+    return ret;
+}
+
+static void epd_drm_remove(struct spi_device *spi)
+{
+    struct drm_device *drm = spi_get_drvdata(spi);
+
+    drm_dev_unplug(drm);
+    drm_atomic_helper_shutdown(drm);
+    EPD_Release(&drm_to_epd(drm)->epd);
+}
+
+static void epd_drm_shutdown(struct spi_device *spi)
+{
+    drm_atomic_helper_shutdown(spi_get_drvdata(spi));
+}
+
+static const struct of_device_id epd_drm_of_match[] = {
+    { .compatible = "waveshare,epd2in13v2" },
+    { /* sentinel */ }
+};
+MODULE_DEVICE_TABLE(of, epd_drm_of_match);
+
+static struct spi_driver epd_drm_spi_driver = {
+    .driver = {
+        .name = "epd2in13v2-drm",
+        .of_match_table = epd_drm_of_match,
+    },
+    .probe = epd_drm_probe,
+    .remove = epd_drm_remove,
+    .shutdown = epd_drm_shutdown,
+};
+module_spi_driver(epd_drm_spi_driver);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("ck");
+MODULE_DESCRIPTION("Waveshare 2.13inch V2 EPD DRM driver");
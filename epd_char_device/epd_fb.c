@@ -0,0 +1,214 @@
+
+/**
+* fbdev 接口, 与 /dev/epd0 共用 display_buf
+**/
+#include <linux/module.h>
+#include <linux/fb.h>
+#include <linux/mm.h>
+
+#include "epd_char_device.h"
+
+static unsigned int fb_defio_ms = 500;
+module_param(fb_defio_ms, uint, 0444);
+MODULE_PARM_DESC(fb_defio_ms, "Batch framebuffer writes for this many ms before refreshing");
+
+// fb_info->par. fbcon 的绘图钩子在 printk 里跑, 可能关着中断, 不能碰 epd->lock:
+// 脏区先记在自己的自旋锁下, 延时周期里 (进程上下文) 再搬进画布
+struct epd_fb {
+    struct epd_dev *epd;            // 注销前置空, 由 io_lock 保护
+    struct mutex io_lock;
+    struct fb_deferred_io defio;
+    spinlock_t damage_lock;
+    struct epd_damage damage;       // 绘图和 write() 的脏区, 由 damage_lock 保护
+};
+
+// 绘图和 write() 只记脏区, 与缺页记下的脏页在同一个延时周期里一起提交
+static void EPD_FbDamage(struct fb_info *info, const struct epd_rect *r)
+{
+    struct epd_fb *efb = info->par;
+    unsigned long flags;
+
+    spin_lock_irqsave(&efb->damage_lock, flags);
+    EPD_DamageRect(&efb->damage, r);
+    spin_unlock_irqrestore(&efb->damage_lock, flags);
+    schedule_delayed_work(&info->deferred_work, info->fbdefio->delay);
+}
+
+static void EPD_FbDamageRange(struct fb_info *info, unsigned long off, size_t len)
+{
+    struct epd_rect r;
+
+    if (EPD_ByteRect(off, len, &r))
+        EPD_FbDamage(info, &r);
+}
+
+static void EPD_FbDamageArea(struct fb_info *info, u32 x, u32 y, u32 w, u32 h)
+{
+    struct epd_rect r;
+
+    if (w && h && EPD_PixelRect(x, y, x + w - 1, y + h - 1, &r))
+        EPD_FbDamage(info, &r);
+}
+
+// 本周期的脏页和绘图脏区合成一次上传和刷新, 每个延时周期最多一帧.
+// fbcon 的光标每个周期都在闪, 交给刷新策略决定, 平时只做局刷
+static void EPD_FbDeferredIo(struct fb_info *info, struct list_head *pagereflist)
+{
+    struct epd_fb *efb = info->par;
+    struct fb_deferred_io_pageref *pageref;
+    struct epd_damage d;
+    struct epd_dev *epd;
+    struct epd_rect r;
+    unsigned long flags;
+    int i;
+
+    spin_lock_irqsave(&efb->damage_lock, flags);
+    d = efb->damage;
+    efb->damage.count = 0;
+    spin_unlock_irqrestore(&efb->damage_lock, flags);
+
+    mutex_lock(&efb->io_lock);
+    epd = efb->epd;
+    if (!epd)
+        goto out;
+    mutex_lock(&epd->lock);
+    for (i = 0; i < d.count; i++)
+        EPD_Damage(epd, &d.rect[i]);
+    list_for_each_entry(pageref, pagereflist, list) {
+        if (EPD_ByteRect(pageref->offset, PAGE_SIZE, &r))
+            EPD_Damage(epd, &r);
+    }
+    if (epd->damage.count)
+        EPD_SubmitFrame(epd, EPD_REFRESH_AUTO, EPD_PRIO_NORMAL);
+    mutex_unlock(&epd->lock);
+out:
+    mutex_unlock(&efb->io_lock);
+}
+
+static ssize_t EPD_FbWrite(struct fb_info *info, const char __user *buf,
+                           size_t count, loff_t *ppos)
+{
+    loff_t off = *ppos;
+    ssize_t ret = fb_sys_write(info, buf, count, ppos);
+
+    if (ret > 0)
+        EPD_FbDamageRange(info, off, ret);
+    return ret;
+}
+
+static void EPD_FbFillRect(struct fb_info *info, const struct fb_fillrect *rect)
+{
+    sys_fillrect(info, rect);
+    EPD_FbDamageArea(info, rect->dx, rect->dy, rect->width, rect->height);
+}
+
+static void EPD_FbCopyArea(struct fb_info *info, const struct fb_copyarea *area)
+{
+    sys_copyarea(info, area);
+    EPD_FbDamageArea(info, area->dx, area->dy, area->width, area->height);
+}
+
+static void EPD_FbImageBlit(struct fb_info *info, const struct fb_image *image)
+{
+    sys_imageblit(info, image);
+    EPD_FbDamageArea(info, image->dx, image->dy, image->width, image->height);
+}
+
+// 最后一个打开 /dev/fbN 的进程走了才释放 fb_info
+static void EPD_FbDestroy(struct fb_info *info)
+{
+    fb_deferred_io_cleanup(info);
+    framebuffer_release(info);
+}
+
+static const struct fb_ops epd_fb_ops = {
+    .owner = THIS_MODULE,
+    .fb_read = fb_sys_read,
+    .fb_write = EPD_FbWrite,
+    .fb_fillrect = EPD_FbFillRect,
+    .fb_copyarea = EPD_FbCopyArea,
+    .fb_imageblit = EPD_FbImageBlit,
+    .fb_mmap = fb_deferred_io_mmap,
+    .fb_destroy = EPD_FbDestroy,
+};
+
+int EPD_FbRegister(struct epd_char *ec, struct device *dev)
+{
+    struct epd_dev *epd = &ec->epd;
+    struct fb_info *info;
+    struct epd_fb *efb;
+    int ret;
+
+    info = framebuffer_alloc(sizeof(*efb), dev);
+    if (!info)
+        return -ENOMEM;
+
+    efb = info->par;
+    efb->epd = epd;
+    mutex_init(&efb->io_lock);
+    spin_lock_init(&efb->damage_lock);
+    efb->defio.delay = msecs_to_jiffies(fb_defio_ms);
+    efb->defio.deferred_io = EPD_FbDeferredIo;
+    info->fbdefio = &efb->defio;
+
+    info->fbops = &epd_fb_ops;
+    info->flags = FBINFO_VIRTFB;
+    info->screen_buffer = epd->display_buf;
+    info->screen_size = WIDTH * HEIGHT;
+
+    // 1 bpp, 字节内高位在左, 1 为白
+    strscpy(info->fix.id, "epd2in13v2", sizeof(info->fix.id));
+    info->fix.type = FB_TYPE_PACKED_PIXELS;
+    info->fix.visual = FB_VISUAL_MONO10;
+    info->fix.line_length = WIDTH;
+    info->fix.smem_start = virt_to_phys(epd->display_buf);
+    info->fix.smem_len = EPD_FB_SIZE;
+    info->fix.accel = FB_ACCEL_NONE;
+
+    info->var.xres = info->var.xres_virtual = EPD_2IN13_V2_WIDTH;
+    info->var.yres = info->var.yres_virtual = EPD_2IN13_V2_HEIGHT;
+    info->var.bits_per_pixel = 1;
+    info->var.grayscale = 1;
+    info->var.red.length = info->var.green.length = info->var.blue.length = 1;
+    info->var.activate = FB_ACTIVATE_NOW;
+    info->var.vmode = FB_VMODE_NONINTERLACED;
+    info->var.width = info->var.height = -1;
+
+    ret = fb_deferred_io_init(info);
+    if (ret)
+        goto err_release;
+
+    ret = register_framebuffer(info);
+    if (ret) {
+        dev_err(dev, "failed to register framebuffer (%d)\n", ret);
+        goto err_defio;
+    }
+    ec->fb = info;
+    dev_info(dev, "fb%d: %ux%u 1bpp, deferred io %u ms\n", info->node,
+             info->var.xres, info->var.yres, fb_defio_ms);
+    return 0;
+
+err_defio:
+    fb_deferred_io_cleanup(info);
+err_release:
+    framebuffer_release(info);
+    return ret;
+}
+
+// 还开着 /dev/fbN 的进程可能让 fb_info 活得比设备久: 先把最后一个周期攒下的
+// 脏区交给刷新线程, 再断开与 epd 的联系, fb_info 留给 EPD_FbDestroy 释放
+void EPD_FbUnregister(struct epd_char *ec)
+{
+    struct fb_info *info = ec->fb;
+    struct epd_fb *efb;
+
+    if (!info)
+        return;
+    efb = info->par;
+    flush_delayed_work(&info->deferred_work);
+    mutex_lock(&efb->io_lock);
+    efb->epd = NULL;
+    mutex_unlock(&efb->io_lock);
+    ec->fb = NULL;
+    unregister_framebuffer(info);
+}
@@ -0,0 +1,100 @@
+
+/**
+* 图层合成: 静态背景加几个叠加层, 只重新合成改过的区域
+**/
+#include <linux/mm.h>
+#include <linux/slab.h>
+
+#include "epd_char_device.h"
+
+#define EPD_LAYER_BYTES (WIDTH * HEIGHT)
+
+static inline uint8_t *EPD_LayerBits(struct epd_dev *epd, unsigned int l)
+{
+    return epd->layer_buf + l * 2 * EPD_LAYER_BYTES;
+}
+
+static inline uint8_t *EPD_LayerMask(struct epd_dev *epd, unsigned int l)
+{
+    return EPD_LayerBits(epd, l) + EPD_LAYER_BYTES;
+}
+
+// 第一次用到图层时分配, 画布当前的内容成为背景, 叠加层全透明.
+// 调用者持有 lock
+static int EPD_LayerInit(struct epd_dev *epd)
+{
+    if (epd->layer_buf)
+        return 0;
+    epd->layer_buf = kvzalloc(EPD_LAYER_COUNT * 2 * EPD_LAYER_BYTES, GFP_KERNEL);
+    if (!epd->layer_buf)
+        return -ENOMEM;
+    memcpy(EPD_LayerBits(epd, 0), epd->display_buf, EPD_LAYER_BYTES);
+    epd->layer_damage.count = 0;
+    return 0;
+}
+
+void EPD_LayerFree(struct epd_dev *epd)
+{
+    kvfree(epd->layer_buf);
+    epd->layer_buf = NULL;
+}
+
+// 把 r 内的字节按图层顺序重新合成进画布
+static void EPD_LayerComposeRect(struct epd_dev *epd, const struct epd_rect *r)
+{
+    const uint8_t *bg = EPD_LayerBits(epd, 0);
+    unsigned int l, off;
+    uint16_t x, y;
+    uint8_t v, m;
+
+    for (y = r->y0; y < r->y1; y++) {
+        for (x = r->x0; x < r->x1; x++) {
+            off = y * WIDTH + x;
+            v = bg[off];
+            for (l = 1; l < EPD_LAYER_COUNT; l++) {
+                m = EPD_LayerMask(epd, l)[off];
+                v = (v & ~m) | (EPD_LayerBits(epd, l)[off] & m);
+            }
+            epd->display_buf[off] = v;
+        }
+    }
+}
+
+// 合成所有改过的区域, 并记为画布的脏区. 调用者持有 lock
+void EPD_LayerCompose(struct epd_dev *epd)
+{
+    int i;
+
+    for (i = 0; i < epd->layer_damage.count; i++) {
+        EPD_LayerComposeRect(epd, &epd->layer_damage.rect[i]);
+        EPD_Damage(epd, &epd->layer_damage.rect[i]);
+    }
+    epd->layer_damage.count = 0;
+}
+
+// 更新一个图层的一块区域; bits/mask 为 NULL 时按 CLEAR / 不透明处理.
+// 调用者持有 lock
+int EPD_LayerUpdate(struct epd_dev *epd, unsigned int l,
+                    unsigned int x, unsigned int y,
+                    unsigned int w, unsigned int h,
+                    const uint8_t *bits, const uint8_t *mask,
+                    unsigned int stride)
+{
+    struct epd_rect r;
+    int ret;
+
+    ret = EPD_LayerInit(epd);
+    if (ret)
+        return ret;
+
+    // 常量源图用 stride 0, 每行都读同一段
+    if (!EPD_BlitBits(EPD_LayerBits(epd, l), x, y, w, h,
+                      bits ? bits : epd_row_zeros, bits ? stride : 0, &r))
+        return 0;
+    if (l)
+        EPD_BlitBits(EPD_LayerMask(epd, l), x, y, w, h,
+                     mask ? mask : (bits ? epd_row_ones : epd_row_zeros),
+                     mask ? stride : 0, &r);
+    EPD_DamageRect(&epd->layer_damage, &r);
+    return 0;
+}
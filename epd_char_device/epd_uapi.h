@@ -0,0 +1,143 @@
+/**
+* /dev/epd0 用户态接口
+**/
+#ifndef _EPD_UAPI_H
+#define _EPD_UAPI_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// mmap 得到的显存: 每行 EPD_FB_STRIDE 字节, 共 EPD_FB_LINES 行,
+// 1 bpp, 字节内高位在左, 1 为白
+#define EPD_FB_WIDTH    122
+#define EPD_FB_LINES    250
+#define EPD_FB_STRIDE   16
+#define EPD_FRAME_SIZE  (EPD_FB_STRIDE * EPD_FB_LINES)
+
+// 每完成一帧, read() 可读出一条记录. 时间戳取 CLOCK_MONOTONIC, 单位 ns
+#define EPD_EVENT_FULL      0x1     // 这一帧用了全刷
+#define EPD_EVENT_SKIPPED   0x2     // 与屏幕内容相同, 没有刷新
+#define EPD_EVENT_STAGED    0x4     // 经 EPD_IOC_STAGE / EPD_IOC_COMMIT 提交
+#define EPD_EVENT_ABORTED   0x8     // 暂存帧被放弃, 没有刷新
+
+struct epd_event {
+    __u32 seq;          // 帧被合并时取最新一次提交的序号
+    __u32 flags;
+    __u64 queued_ns;    // 最新一次提交进入信箱
+    __u64 upload_ns;    // 写完 RAM 0x24
+    __u64 refresh_ns;   // BUSY 释放, 画面已在屏上
+};
+
+// EPD_IOC_FLUSH 的刷新方式
+#define EPD_FLUSH_DEFAULT   0       // 用 sysfs refresh_mode
+#define EPD_FLUSH_FULL      1
+#define EPD_FLUSH_PARTIAL   2
+#define EPD_FLUSH_AUTO      3
+#define EPD_FLUSH_CLEAR     4       // 先整屏刷白再全刷, 彻底消除残影
+
+// 把显存中的一块区域提交刷新. 坐标以像素计, w 或 h 为 0 表示整屏
+struct epd_flush {
+    __u32 x, y;
+    __u32 w, h;
+    __u32 mode;
+};
+
+#define EPD_IOC_MAGIC   'E'
+#define EPD_IOC_FLUSH   _IOW(EPD_IOC_MAGIC, 1, struct epd_flush)
+
+// 本次打开的 write() 如何解释, 默认文本
+#define EPD_MODE_TEXT   0       // 文本, 像终端一样追加, 支持 \n \r \b \t \f 和 ESC[7m/0m/2J/H/K
+#define EPD_MODE_FRAME  1       // 原始 1bpp 显存, 写在文件位置处, 立即提交
+#define EPD_IOC_SET_MODE    _IOW(EPD_IOC_MAGIC, 2, __u32)
+
+// 整块屏的文字用哪种字体, 默认 12 点, 所有打开的文件共用一个文字网格.
+// 换成不同的字体时先擦掉原有文字, 再按新字体的格子大小从左上角开始;
+// 之后各文件的文本 write() 都用这个字体
+#define EPD_FONT_12         0       // 7x12
+#define EPD_FONT_24         1       // 14x24, 12 点字库放大两倍
+#define EPD_FONT_COUNT      2
+#define EPD_IOC_SET_FONT    _IOW(EPD_IOC_MAGIC, 8, __u32)
+
+// 本次打开的提交属于哪个优先级, 默认 NORMAL. 紧急帧不受刷新限速,
+// 信箱里等待的低优先级帧会和它合并, 一起在下一次刷新上屏
+#define EPD_PRIO_BACKGROUND 0
+#define EPD_PRIO_NORMAL     1
+#define EPD_PRIO_URGENT     2
+#define EPD_PRIO_COUNT      3
+#define EPD_IOC_SET_PRIO    _IOW(EPD_IOC_MAGIC, 6, __u32)
+
+// 批量贴图: 源数据从 src_offset 开始, 1 bpp, 字节内高位在左,
+// 每行 (w + 7) / 8 字节, 共 h 行. 坐标以像素计, 超出屏幕的部分裁掉
+struct epd_blit {
+    __u32 x, y;
+    __u32 w, h;
+    __u32 src_offset;
+};
+
+#define EPD_BATCH_MAX       64          // 一次最多几块
+#define EPD_BATCH_SRC_MAX   (4 * EPD_FRAME_SIZE)
+
+#define EPD_BATCH_COMMIT    0x1         // 贴完合并脏区, 提交一帧
+
+struct epd_update_batch {
+    __u64 blits;        // struct epd_blit 数组的用户态地址
+    __u64 src;          // 源数据的用户态地址
+    __u32 count;
+    __u32 src_len;
+    __u32 flags;
+    __u32 mode;         // EPD_FLUSH_*
+};
+
+#define EPD_IOC_UPDATE_BATCH    _IOW(EPD_IOC_MAGIC, 3, struct epd_update_batch)
+
+// 图层: 0 为背景, 其余为叠加层, 每层一张整屏 1 bpp 位图, 叠加层另有一张掩码 (1 为不透明).
+// 合成时从背景开始, 依次把叠加层不透明的像素盖上去. 只有改过的区域会重新合成和上传.
+// 第一次使用图层时, 画布当前的内容成为背景
+#define EPD_LAYER_COUNT     4
+
+#define EPD_LAYER_COMMIT    0x1     // 合成所有改过的区域并提交一帧
+#define EPD_LAYER_CLEAR     0x2     // 把这块区域变透明 (叠加层) 或置零 (背景), 忽略 bits/mask
+
+struct epd_layer_update {
+    __u32 layer;
+    __u32 x, y;         // 像素坐标, 超出屏幕的部分裁掉
+    __u32 w, h;
+    __u32 flags;
+    __u32 mode;         // EPD_FLUSH_*, 只在 EPD_LAYER_COMMIT 时有用
+    __u32 reserved;
+    __u64 bits;         // 1 bpp, 字节内高位在左, 每行 (w + 7) / 8 字节
+    __u64 mask;         // 与 bits 同样布局; 0 表示整块不透明, 背景层忽略
+};
+
+#define EPD_IOC_LAYER_UPDATE    _IOW(EPD_IOC_MAGIC, 7, struct epd_layer_update)
+
+// 两段式提交: EPD_IOC_STAGE 把显存中的区域 (参数同 EPD_IOC_FLUSH) 预先写进控制器 RAM,
+// 返回帧序号; EPD_IOC_COMMIT 立即或在 deadline 时刻只发刷新触发.
+// 暂存到提交之间, 其它提交在信箱里等待. 带 EPD_COMMIT_ABORT 时放弃暂存帧
+// (还没到点的定时提交也一起取消), 这些区域留给下一次提交刷出去.
+// 暂存的文件关闭时还没提交, 暂存帧同样被放弃
+#define EPD_COMMIT_ABORT    0x1
+
+struct epd_commit {
+    __u64 deadline_ns;  // 0 立即提交, 否则为 clock 上的绝对时间
+    __u32 clock;        // CLOCK_MONOTONIC 或 CLOCK_REALTIME
+    __u32 flags;        // EPD_COMMIT_*
+};
+
+#define EPD_IOC_STAGE   _IOW(EPD_IOC_MAGIC, 4, struct epd_flush)
+#define EPD_IOC_COMMIT  _IOW(EPD_IOC_MAGIC, 5, struct epd_commit)
+
+// io_uring IORING_OP_URING_CMD 的 cmd_op, 参数放在 sqe 的 16 字节 cmd 区.
+// 帧真正刷完 (或因与屏幕相同被跳过) 时才产生 CQE, res 为帧序号, 与 struct epd_event.seq 对应
+#define EPD_URING_WRITE     1   // 从 addr 拷 len 字节到显存 offset 处并提交
+#define EPD_URING_FLUSH     2   // 把显存 [offset, offset + len) 提交刷新, len 为 0 表示整屏
+
+struct epd_uring_cmd {
+    __u64 addr;
+    __u32 offset;
+    __u16 len;
+    __u8 mode;          // EPD_FLUSH_*
+    __u8 reserved;
+};
+
+#endif
@@ -2,13 +2,22 @@
 #include <linux/init.h>
 //#include <linux/fs.h>
 #include <linux/tty.h>
+#include <linux/tty_flip.h>
 #include <linux/delay.h>
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/console.h>
+#include <linux/irq_work.h>
+#include <linux/panic_notifier.h>
 
 MODULE_LICENSE("GPL v2");
 //MODULE_AUTHOR("author");
 //MODULE_DESCRIPTION("E-Paper Display Console Driver");
 
 #include "EPD.h"
+#include "lib/font/font12.c"
 
 #define DRIVER_NAME "epd_tty"
 #define EPD_TTY_MAJOR 240
@@ -17,62 +26,289 @@ MODULE_LICENSE("GPL v2");
 #define EPD_WIDTH 122
 #define EPD_HEIGHT 250
 
+#define EPD_TTY_RING_SIZE 4096  // 2 的幂, kfifo 要求
+// 横屏, 字高沿面板宽度方向
+#define EPD_TTY_COLS (EPD_HEIGHT / 7)
+#define EPD_TTY_ROWS (EPD_WIDTH / 12)
+
+static unsigned int refresh_ms = 1000;
+module_param(refresh_ms, uint, 0644);
+MODULE_PARM_DESC(refresh_ms, "Refresh the panel at most once per this many ms");
 
 // 全局变量
 static struct tty_driver *epd_tty_driver;
+static struct tty_port epd_tty_port;
+
+// write() 是生产者, 渲染线程是唯一的消费者. 写入可能在原子上下文里,
+// 回显和正常输出也可能同时进来, 所以生产者之间用自旋锁排队, 消费者不加锁
+static DEFINE_KFIFO(epd_tty_fifo, u8, EPD_TTY_RING_SIZE);
+static DEFINE_SPINLOCK(epd_tty_fifo_lock);
+
+static void epd_tty_render(struct work_struct *work);
+static DECLARE_DELAYED_WORK(epd_tty_work, epd_tty_render);
+static unsigned long epd_tty_last_refresh;     // 上次刷新的 jiffies
+static atomic_t epd_tty_busy = ATOMIC_INIT(0); // 渲染线程或 panic 正在碰硬件
+
+// 内核日志环: console write 是唯一的生产者 (console 层已串行化), 满了覆盖最旧的.
+// 渲染线程是唯一的消费者, 落后超过一圈就跳到最近的 EPD_LOG_SIZE 字节
+#define EPD_LOG_SIZE 4096       // 2 的幂
+static char epd_log_buf[EPD_LOG_SIZE];
+static unsigned long epd_log_head;      // 只由 console write 推进
+static unsigned long epd_log_tail;      // 只由消费者推进
+
+// 以下只在渲染线程里访问
+static UBYTE *epd_tty_image;
+static char epd_tty_cells[EPD_TTY_ROWS][EPD_TTY_COLS];
+static char epd_tty_shown[EPD_TTY_ROWS][EPD_TTY_COLS];
+static int epd_tty_x, epd_tty_y;
 
-// 显示测试
-static void test(UBYTE * image) {
-    const int width = WIDTH;
-    const int height = HEIGHT;
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width * 8; x++) {
-            if ((x / 8 + y / 8) % 2 == 0) {       // 每 8x8 像素一个黑白块
-                image[y * width + x / 8] |= (1 << (7 - x % 8));
-            }
+/*------------------------- 文字网格 -------------------------*/
+static void epd_tty_newline(void)
+{
+    if (++epd_tty_y < EPD_TTY_ROWS)
+        return;
+    epd_tty_y = EPD_TTY_ROWS - 1;
+    memmove(epd_tty_cells[0], epd_tty_cells[1], (EPD_TTY_ROWS - 1) * EPD_TTY_COLS);
+    memset(epd_tty_cells[EPD_TTY_ROWS - 1], ' ', EPD_TTY_COLS);
+}
+
+static void epd_tty_putc(char ch)
+{
+    switch (ch) {
+    case '\n':
+        epd_tty_newline();
+        break;
+    case '\r':
+        epd_tty_x = 0;
+        break;
+    case '\b':
+        if (epd_tty_x)
+            epd_tty_x--;
+        break;
+    case '\t':
+        epd_tty_x = min((epd_tty_x + 8) & ~7, EPD_TTY_COLS - 1);
+        break;
+    case '\f':
+        memset(epd_tty_cells, ' ', sizeof(epd_tty_cells));
+        epd_tty_x = epd_tty_y = 0;
+        break;
+    default:
+        if (ch < ' ' || ch > '~')
+            break;
+        if (epd_tty_x >= EPD_TTY_COLS) {
+            epd_tty_x = 0;
+            epd_tty_newline();
         }
+        epd_tty_cells[epd_tty_y][epd_tty_x++] = ch;
+        break;
     }
-    
-    EPD_Display(image);
-    msleep(4000);
+}
 
-    EPD_Clear();
-    msleep(500); 
+// 横屏画一个字符, 白底黑字 (1 为白)
+static void epd_tty_draw_char(int col, int row, char ch)
+{
+    const UBYTE *ptr = &Font12.table[(ch - ' ') * Font12.Height];
+    int x = col * Font12.Width, y = row * Font12.Height;
+    int i, j, real_x, real_y;
+
+    for (j = 0; j < Font12.Height; j++) {
+        UBYTE line = ptr[j];
+
+        for (i = 0; i < Font12.Width; i++, line <<= 1) {
+            real_x = EPD_WIDTH - 1 - y - j;
+            real_y = x + i;
+            if (line & 0x80)
+                epd_tty_image[real_y * WIDTH + real_x / 8] &= ~(1 << (7 - real_x % 8));
+            else
+                epd_tty_image[real_y * WIDTH + real_x / 8] |= 1 << (7 - real_x % 8);
+        }
+    }
 }
 
-// TTY操作函数集
-static int epd_tty_open(struct tty_struct *tty, struct file *file)
+// 只重画变了的格子, 返回是否需要刷新
+static bool epd_tty_draw(void)
 {
-    // 计算图像缓冲区大小
-    const int buffer_size = WIDTH * HEIGHT;
- 
-    // 分配图像内存
-    UBYTE *image = (UBYTE *)kmalloc(buffer_size, GFP_KERNEL);
-    if(image == NULL) {
-        Debug("Failed to allocate memory\n");
-        return -1;
+    bool changed = false;
+    int r, c;
+
+    for (r = 0; r < EPD_TTY_ROWS; r++) {
+        for (c = 0; c < EPD_TTY_COLS; c++) {
+            if (epd_tty_cells[r][c] == epd_tty_shown[r][c])
+                continue;
+            epd_tty_draw_char(c, r, epd_tty_cells[r][c]);
+            epd_tty_shown[r][c] = epd_tty_cells[r][c];
+            changed = true;
+        }
     }
-    memset(image, 0x00, buffer_size);
+    return changed;
+}
 
-    test(image);
+/*------------------------- 渲染线程 -------------------------*/
+// 距上次刷新不足 refresh_ms 时推迟到期满
+static unsigned long epd_tty_delay(void)
+{
+    unsigned long next = READ_ONCE(epd_tty_last_refresh) + msecs_to_jiffies(refresh_ms);
 
-    return 0;
+    return time_after(next, jiffies) ? next - jiffies : 0;
+}
+
+// 把日志环里还没显示的部分取进网格. 读的同时生产者可能在覆盖,
+// 读完再看一次 head, 被覆盖的那段丢掉
+static void epd_log_drain(void)
+{
+    unsigned long head, pos;
+    char buf[64];
+    unsigned int n, i;
+
+    for (;;) {
+        head = smp_load_acquire(&epd_log_head);
+        if (head - epd_log_tail > EPD_LOG_SIZE)
+            epd_log_tail = head - EPD_LOG_SIZE;
+        if (head == epd_log_tail)
+            return;
+        pos = epd_log_tail;
+        n = min_t(unsigned long, head - pos, sizeof(buf));
+        for (i = 0; i < n; i++)
+            buf[i] = epd_log_buf[(pos + i) % EPD_LOG_SIZE];
+        smp_rmb();
+        if (READ_ONCE(epd_log_head) - pos > EPD_LOG_SIZE)
+            continue;
+        for (i = 0; i < n; i++)
+            epd_tty_putc(buf[i]);
+        epd_log_tail = pos + n;
+    }
+}
+
+// 取出内核日志和 tty 环里的全部数据
+static void epd_tty_drain(void)
+{
+    u8 buf[64];
+    unsigned int n, i;
+
+    epd_log_drain();
+    while ((n = kfifo_out(&epd_tty_fifo, buf, sizeof(buf)))) {
+        for (i = 0; i < n; i++)
+            epd_tty_putc(buf[i]);
+    }
+}
+
+// 把环里的数据全部取进网格, 马上唤醒等空间的写者, 再刷新一次屏幕.
+// 刷新期间写进来的数据留到下一个周期
+static void epd_tty_render(struct work_struct *work)
+{
+    unsigned long delay;
+
+    // panic 已经接管了屏幕
+    if (atomic_cmpxchg(&epd_tty_busy, 0, 1))
+        return;
+    epd_tty_drain();
+    tty_port_tty_wakeup(&epd_tty_port);
+
+    // 刷新期间的写入把这次刷新的开始当作上次刷新, 两次刷新至少隔 refresh_ms
+    delay = epd_tty_delay();
+    if (delay) {
+        schedule_delayed_work(&epd_tty_work, delay);
+        goto out;
+    }
+    if (!epd_tty_draw())
+        goto out;
+    WRITE_ONCE(epd_tty_last_refresh, jiffies);
+    EPD_DisplayPart(epd_tty_image);
+
+    if (!kfifo_is_empty(&epd_tty_fifo) ||
+        READ_ONCE(epd_log_head) != epd_log_tail)
+        schedule_delayed_work(&epd_tty_work, epd_tty_delay());
+out:
+    atomic_set(&epd_tty_busy, 0);
+}
+
+/*------------------------- 内核 console -------------------------*/
+// console write 可能在任何上下文里, 调度 work 又可能再次 printk,
+// 所以只在 irq_work 里排渲染线程
+static void epd_log_kick(struct irq_work *work)
+{
+    schedule_delayed_work(&epd_tty_work, epd_tty_delay());
+}
+static DEFINE_IRQ_WORK(epd_log_work, epd_log_kick);
+
+// 只追加进日志环, 不睡眠, 不碰 SPI
+static void epd_console_write(struct console *con, const char *s, unsigned int count)
+{
+    unsigned long head = epd_log_head;
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+        epd_log_buf[(head + i) % EPD_LOG_SIZE] = s[i];
+    smp_store_release(&epd_log_head, head + count);
+    irq_work_queue(&epd_log_work);
+}
+
+static struct tty_driver *epd_console_device(struct console *con, int *index)
+{
+    *index = con->index;
+    return epd_tty_driver;
+}
+
+static struct console epd_console = {
+    .name = "ttyEPD",
+    .write = epd_console_write,
+    .device = epd_console_device,
+    // 无头设备上不等 console= 参数, 注册即启用, 并补上注册前的启动日志
+    .flags = CON_PRINTBUFFER | CON_ENABLED,
+    .index = 0,
+};
+
+// panic 时其他 CPU 已停, 渲染线程不会再跑: 同步画完最后几行并尽力局刷一次.
+// 渲染线程停在刷新半路, 或 SPI 总线/控制器正被占着时不碰硬件, 屏幕保留上一帧.
+// 刷新路径在 oops_in_progress 下只发短事务、按 mdelay 计次等 BUSY,
+// 总时长有上限, 不会挡住 panic=N 重启
+static int epd_console_panic(struct notifier_block *nb, unsigned long event, void *data)
+{
+    if (atomic_cmpxchg(&epd_tty_busy, 0, 1))
+        return NOTIFY_DONE;
+    epd_tty_drain();
+    if (epd_tty_draw() && SPI_Idle())
+        EPD_DisplayPart(epd_tty_image);
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block epd_console_panic_nb = {
+    .notifier_call = epd_console_panic,
+};
+
+// TTY操作函数集
+static const struct tty_port_operations epd_tty_port_ops = {
+};
+
+static int epd_tty_open(struct tty_struct *tty, struct file *file)
+{
+    return tty_port_open(&epd_tty_port, tty, file);
 }
 
 static void epd_tty_close(struct tty_struct *tty, struct file *file)
 {
-    // 可添加清理代码
+    tty_port_close(&epd_tty_port, tty, file);
 }
 
+// 只拷进环里就返回, 放不下的部分由 tty 层在 write_wakeup 后重试
 static ssize_t epd_tty_write(struct tty_struct *tty, const u8 *buf, size_t count)
 {
-    //epd_display_text(buf, count);
-    return count;
+    unsigned int n;
+
+    n = kfifo_in_spinlocked(&epd_tty_fifo, buf, count, &epd_tty_fifo_lock);
+    if (n)
+        schedule_delayed_work(&epd_tty_work, epd_tty_delay());
+    return n;
 }
 
 static unsigned int epd_tty_write_room(struct tty_struct *tty)
 {
-    return 4096;
+    return kfifo_avail(&epd_tty_fifo);
+}
+
+static unsigned int epd_tty_chars_in_buffer(struct tty_struct *tty)
+{
+    return kfifo_len(&epd_tty_fifo);
 }
 
 static const struct tty_operations epd_tty_ops = {
@@ -80,6 +316,7 @@ static const struct tty_operations epd_tty_ops = {
     .close = epd_tty_close,
     .write = epd_tty_write,
     .write_room = epd_tty_write_room,
+    .chars_in_buffer = epd_tty_chars_in_buffer,
 };
 
 // 初始化TTY驱动
@@ -98,11 +335,15 @@ static int epd_tty_init(void)
     epd_tty_driver->init_termios = tty_std_termios;
     
     tty_set_operations(epd_tty_driver, &epd_tty_ops);
+    tty_port_init(&epd_tty_port);
+    epd_tty_port.ops = &epd_tty_port_ops;
+    tty_port_link_device(&epd_tty_port, epd_tty_driver, 0);
     
     int ret = tty_register_driver(epd_tty_driver);
     if (ret) {
         pr_err("Failed to register EPD TTY driver\n");
         tty_driver_kref_put(epd_tty_driver);
+        tty_port_destroy(&epd_tty_port);
         return ret;
     }
     
@@ -114,28 +355,57 @@ static int __init epd_driver_init(void)
 {
     pr_info("EPD Console Driver Initializing\n");
 
+    // 白屏, 网格全是空格
+    epd_tty_image = kmalloc(WIDTH * HEIGHT, GFP_KERNEL);
+    if (!epd_tty_image)
+        return -ENOMEM;
+    memset(epd_tty_image, 0xFF, WIDTH * HEIGHT);
+    memset(epd_tty_cells, ' ', sizeof(epd_tty_cells));
+    memset(epd_tty_shown, ' ', sizeof(epd_tty_shown));
+    epd_tty_last_refresh = jiffies - msecs_to_jiffies(refresh_ms);
+
     // 初始化GPIO SPI
-    DEV_Hardware_Init();
+    if (DEV_Hardware_Init()) {
+        kfree(epd_tty_image);
+        return -ENOMEM;
+    }
     // 初始化屏幕
     EPD_init_full();
 
     EPD_Clear();
     msleep(500);
+    // 之后只做局刷
+    EPD_init_part();
     
     // 初始化tty驱动
     int ret = epd_tty_init();
-    if (ret)
+    if (ret) {
+        DEV_Hardware_Exit();
+        kfree(epd_tty_image);
         return ret;
+    }
+
+    // 内核日志也显示到屏幕上
+    atomic_notifier_chain_register(&panic_notifier_list, &epd_console_panic_nb);
+    register_console(&epd_console);
         
     return 0;
 }
 
 static void __exit epd_driver_exit(void)
 {
+    unregister_console(&epd_console);
+    irq_work_sync(&epd_log_work);
+    atomic_notifier_chain_unregister(&panic_notifier_list, &epd_console_panic_nb);
+
     tty_unregister_driver(epd_tty_driver);
     tty_driver_kref_put(epd_tty_driver);
+    // 渲染线程是最后一个碰 port 和硬件的
+    cancel_delayed_work_sync(&epd_tty_work);
+    tty_port_destroy(&epd_tty_port);
 
     DEV_Hardware_Exit();
+    kfree(epd_tty_image);
     
     pr_info("EPD Console Driver Removed\n");
 }